@@ -0,0 +1,148 @@
+#ifndef AWAITABLE
+#define AWAITABLE
+
+#include "common_defs.h"
+#include <coroutine>
+#include <deque>
+#include <memory>
+
+/*
+Coroutines over the transports, so a flow of several steps (connect, send,
+wait for the answer) reads top to bottom but gives its thread back while it
+waits:
+
+    Task            a coroutine that starts when called and runs on its own,
+                    nobody waits for it to finish
+    Awaitable<T>    what connect of the clients, accept of the servers and
+                    receive of both return; co_await starts the operation
+                    and suspends until it finishes with a T
+    Waiters<T>      the coroutines a transport's loop owes the next of
+                    something, in the order they asked
+
+An operation only starts once its coroutine is suspended and always finishes
+from the transport's loop, so a coroutine never goes on on the thread that
+called it: whatever it locked there is released when it first suspends, and
+what it does after a co_await runs on the loop like a callback would, taking
+the same locks a callback takes.
+*/
+
+struct Task {
+    struct promise_type {
+        Task get_return_object() {
+            return Task();
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        // nobody waits for a Task and it is resumed on a transport's loop, so
+        // what escapes it is reported here rather than ending the process;
+        // a coroutine that must not go on after an error handles it itself
+        void unhandled_exception() {
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                std::cerr << "Error in coroutine: " << e.what() << "\n";
+            } catch (...) {
+                std::cerr << "Unknown error in coroutine\n";
+            }
+        }
+    };
+};
+
+template<typename T>
+class Awaitable {
+public:
+
+    // start gets the function to finish the operation with, to be called
+    // from the transport's loop
+    explicit Awaitable(std::function<void(std::function<void(T)>)> _start) : start(std::move(_start)) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    // the coroutine may go on, finish and take this awaiter with it before
+    // start returns, so neither start nor the finishing function touch the
+    // awaiter once the operation is under way
+    void await_suspend(std::coroutine_handle<> handle) {
+        std::shared_ptr<Outcome> finished = outcome;
+        std::function<void(std::function<void(T)>)> begin = std::move(start);
+        begin([finished, handle](T value) {
+            finished->result = std::move(value);
+            handle.resume();
+        });
+    }
+
+    T await_resume() {
+        return std::move(outcome->result);
+    }
+
+private:
+    struct Outcome {
+        T result{};
+    };
+
+    std::function<void(std::function<void(T)>)> start;
+    std::shared_ptr<Outcome> outcome = std::make_shared<Outcome>();
+};
+
+template<typename T>
+class Waiters {
+public:
+
+    // from any thread
+    void add(std::function<void(T)> onReady) {
+        std::unique_lock<std::mutex> lock(waitersLock);
+        waiting.push_back(std::move(onReady));
+        numWaiting.store(waiting.size());
+    }
+
+    bool empty() const {
+        return numWaiting.load() == 0;
+    }
+
+    // hands value to the first waiter, returns false and leaves value alone
+    // if there is none
+    bool offer(T& value) {
+        if (numWaiting.load() == 0) return false;
+        std::function<void(T)> next;
+        {
+            std::unique_lock<std::mutex> lock(waitersLock);
+            if (waiting.empty()) return false;
+            next = std::move(waiting.front());
+            waiting.pop_front();
+            numWaiting.store(waiting.size());
+        }
+        next(std::move(value));
+        return true;
+    }
+
+    // finishes every waiter with value, for what will never come
+    void finishAll(const T& value) {
+        if (numWaiting.load() == 0) return;
+        std::deque<std::function<void(T)>> finished;
+        {
+            std::unique_lock<std::mutex> lock(waitersLock);
+            finished.swap(waiting);
+            numWaiting.store(0);
+        }
+        for(std::function<void(T)>& next: finished)
+            next(value);
+    }
+
+private:
+    std::mutex waitersLock;
+    std::deque<std::function<void(T)>> waiting;
+    // checked without the lock for every frame
+    std::atomic<size_t> numWaiting{0};
+};
+
+#endif
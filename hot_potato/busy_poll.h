@@ -0,0 +1,200 @@
+#ifndef BUSY_POLL
+#define BUSY_POLL
+
+#include "common_defs.h"
+#include <chrono>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+
+/*
+Low latency mode, for runs that may burn whole cores:
+
+    SpinBudget      an event loop polls its sockets without sleeping for as
+                    long as something happened within the last spinUs, and
+                    only then goes back to sleeping in select
+    ThreadPlacement pins the event loop and worker threads of the process to
+                    the CPUs given with --cpus, one after the other
+
+--cpus takes a list like 2,4-7 or numa. With numa a player spreads its
+threads over all CPUs until it knows its id, then moves them onto one NUMA
+node: the ids are split into one contiguous range per node, so most ring
+neighbours share a node and their potatoes stay in its memory, which the
+kernel allocates on the node of the thread that first touches it.
+*/
+
+class SpinBudget {
+public:
+
+    SpinBudget(int spinUs = 0) : budget(std::chrono::microseconds(spinUs)) {
+        lastEvent = std::chrono::steady_clock::now();
+    }
+
+    // how long the loop's select may wait: not at all while spinning,
+    // otherwise blocking, the loop's own timeout
+    struct timeval timeout(struct timeval blocking) {
+        if (budget.count() == 0 || std::chrono::steady_clock::now() - lastEvent >= budget)
+            return blocking;
+        // a CPU shared with other spinning threads is handed on between polls
+        sched_yield();
+        return timeval{0, 0};
+    }
+
+    // with what select returned
+    void onSelect(int numReady) {
+        if (budget.count() > 0 && numReady > 0)
+            lastEvent = std::chrono::steady_clock::now();
+    }
+
+private:
+    std::chrono::steady_clock::duration budget;
+    std::chrono::steady_clock::time_point lastEvent;
+};
+
+// "2,4-7" to {2, 4, 5, 6, 7}, also the format of the kernel's node lists
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        if (first < 0 || last < first)
+            throw std::runtime_error("Bad CPU range " + range);
+        for(int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// the CPUs of each online NUMA node, a single node with every online CPU if
+// the system does not say; node numbers may have gaps
+std::vector<std::vector<int>> numaNodes() {
+    std::vector<std::vector<int>> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string onlineList;
+    if (online && std::getline(online, onlineList)) {
+        for(int node: parseCpuList(onlineList)) {
+            std::ifstream cpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!cpuList || !std::getline(cpuList, list)) continue;
+            std::vector<int> cpus = parseCpuList(list);
+            if (!cpus.empty()) nodes.push_back(cpus);
+        }
+    }
+    if (nodes.empty()) {
+        std::vector<int> cpus;
+        long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for(long cpu = 0; cpu < numCpus; cpu++) cpus.push_back((int) cpu);
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+// the node of a player: ids are split into contiguous ranges, one per node
+size_t numaNodeOf(size_t playerId, size_t numPlayers, size_t numNodes) {
+    if (numPlayers == 0) return 0;
+    return std::min(playerId * numNodes / numPlayers, numNodes - 1);
+}
+
+// how many players of the same node come before this one
+size_t numaRankOf(size_t playerId, size_t numPlayers, size_t numNodes) {
+    size_t node = numaNodeOf(playerId, numPlayers, numNodes);
+    size_t first = playerId;
+    while (first > 0 && numaNodeOf(first - 1, numPlayers, numNodes) == node) first--;
+    return playerId - first;
+}
+
+class ThreadPlacement {
+public:
+
+    // never destroyed, detached loop threads may still be on their way out
+    // when the statics go at exit
+    static ThreadPlacement& instance() {
+        static ThreadPlacement* placement = new ThreadPlacement();
+        return *placement;
+    }
+
+    // what --cpus said, empty leaves threads wherever the scheduler puts them
+    void configure(const std::string& spec) {
+        std::unique_lock<std::mutex> lock(placementLock);
+        numa = spec == "numa";
+        if (numa) {
+            cpus.clear();
+            for(const std::vector<int>& node: numaNodes())
+                cpus.insert(cpus.end(), node.begin(), node.end());
+        } else {
+            cpus = parseCpuList(spec);
+        }
+        nextCpu = 0;
+    }
+
+    bool isNuma() {
+        std::unique_lock<std::mutex> lock(placementLock);
+        return numa;
+    }
+
+    // moves every pinned thread and those still to come onto the CPUs of
+    // the node a player of that id belongs on; the players of a node start
+    // on different CPUs of it, one further each
+    void placeOnNode(size_t playerId, size_t numPlayers) {
+        std::vector<std::vector<int>> nodes = numaNodes();
+        std::unique_lock<std::mutex> lock(placementLock);
+        cpus = nodes[numaNodeOf(playerId, numPlayers, nodes.size())];
+        nextCpu = numaRankOf(playerId, numPlayers, nodes.size());
+        for(std::pair<const pthread_t, int>& thread: threads) {
+            thread.second = cpus[nextCpu++ % cpus.size()];
+            pin(thread.first, thread.second);
+        }
+    }
+
+    // pins the calling thread to the next CPU, for as long as it is
+    // registered; returns whether it was
+    bool registerCurrentThread() {
+        std::unique_lock<std::mutex> lock(placementLock);
+        if (cpus.empty()) return false;
+        int cpu = cpus[nextCpu++ % cpus.size()];
+        threads[pthread_self()] = cpu;
+        pin(pthread_self(), cpu);
+        return true;
+    }
+
+    // before the calling thread exits
+    void unregisterCurrentThread() {
+        std::unique_lock<std::mutex> lock(placementLock);
+        threads.erase(pthread_self());
+    }
+
+private:
+    static void pin(pthread_t thread, int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int status = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (status != 0)
+            std::cerr << "Warning: could not pin a thread to CPU " << cpu << ": " << strerror(status) << '\n';
+    }
+
+    std::mutex placementLock;
+    std::vector<int> cpus;
+    size_t nextCpu = 0;
+    bool numa = false;
+    std::map<pthread_t, int> threads;
+};
+
+// a thread pinned by ThreadPlacement while this is in scope
+struct PinnedThread {
+    PinnedThread() {
+        registered = ThreadPlacement::instance().registerCurrentThread();
+    }
+
+    ~PinnedThread() {
+        if (registered) ThreadPlacement::instance().unregisterCurrentThread();
+    }
+
+    bool registered;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef CHECKPOINT
+#define CHECKPOINT
+
+#include "common_defs.h"
+#include <fstream>
+#include <sstream>
+
+/*
+Snapshot of a running game, enough for a restarted ringmaster to pick it up:
+
+    hot_potato snapshot 1
+    players <n>
+    hops <hops>
+    seed <seed>
+    trace ids|bits
+    payload <bytes>
+    tree-fanout <children>
+    checkpoint-hops <hops>
+    epoch <epoch>
+    player <id> <host> <port>           one per player
+    potato <holder> <Give_Potato args>  the last checkpoint, if any
+
+The potato args are joined with the command token delimiter, exactly as they
+were on the wire, so the trace so far comes back byte for byte.
+*/
+
+constexpr static char SNAPSHOT_HEADER[] = "hot_potato snapshot 1";
+
+struct GameSnapshot {
+    size_t numPlayers = 0;
+    size_t numHops = 0;
+    unsigned int seed = 0;
+    std::string traceMode = "ids";
+    size_t payloadSize = 0;
+    size_t treeFanout = 0;
+    size_t checkpointHops = 0;
+    size_t epoch = 0;
+    std::vector<std::string> hostNames, ports;
+
+    bool hasPotato = false;
+    size_t potatoHolder = 0;
+    std::string potatoArgs;
+
+    // writes a temporary file and renames it over path, so a crash mid-write
+    // leaves the previous snapshot in place
+    int save(const std::string& path) const {
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::trunc);
+            if (!out) {
+                std::cerr << "Error: cannot write snapshot " << tmpPath << '\n';
+                return -1;
+            }
+            out << SNAPSHOT_HEADER << '\n'
+                << "players " << numPlayers << '\n'
+                << "hops " << numHops << '\n'
+                << "seed " << seed << '\n'
+                << "trace " << traceMode << '\n'
+                << "payload " << payloadSize << '\n'
+                << "tree-fanout " << treeFanout << '\n'
+                << "checkpoint-hops " << checkpointHops << '\n'
+                << "epoch " << epoch << '\n';
+            for(size_t playerId = 0; playerId < numPlayers; playerId++)
+                out << "player " << playerId << ' ' << hostNames[playerId] << ' ' << ports[playerId] << '\n';
+            if (hasPotato)
+                out << "potato " << potatoHolder << ' ' << potatoArgs << '\n';
+            out.flush();
+            if (!out) {
+                std::cerr << "Error: cannot write snapshot " << tmpPath << '\n';
+                return -1;
+            }
+        }
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "Error: cannot replace snapshot " << path << ": " << strerror(errno) << '\n';
+            return -1;
+        }
+        return 0;
+    }
+
+    int load(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        if (!in || !std::getline(in, line) || line != SNAPSHOT_HEADER) {
+            std::cerr << "Error: " << path << " is not a game snapshot\n";
+            return -1;
+        }
+
+        size_t numAddresses = 0;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            fields >> key;
+            if (key == "players") {
+                fields >> numPlayers;
+                hostNames.resize(numPlayers);
+                ports.resize(numPlayers);
+            }
+            else if (key == "hops") fields >> numHops;
+            else if (key == "seed") fields >> seed;
+            else if (key == "trace") fields >> traceMode;
+            else if (key == "payload") fields >> payloadSize;
+            else if (key == "tree-fanout") fields >> treeFanout;
+            else if (key == "checkpoint-hops") fields >> checkpointHops;
+            else if (key == "epoch") fields >> epoch;
+            else if (key == "player") {
+                size_t playerId;
+                fields >> playerId;
+                if (!fields || playerId >= numPlayers) break;
+                fields >> hostNames[playerId] >> ports[playerId];
+                numAddresses++;
+            }
+            else if (key == "potato") {
+                fields >> potatoHolder >> potatoArgs;
+                hasPotato = true;
+            }
+            if (!fields) {
+                std::cerr << "Error: malformed snapshot line \"" << line << "\" in " << path << '\n';
+                return -1;
+            }
+        }
+
+        if (numPlayers == 0 || numAddresses != numPlayers || (hasPotato && potatoHolder >= numPlayers)) {
+            std::cerr << "Error: snapshot " << path << " is incomplete\n";
+            return -1;
+        }
+        return 0;
+    }
+};
+
+#endif
@@ -1,16 +1,23 @@
 #ifndef CLIENT
 #define CLIENT
 #include "common_defs.h"
+#include "framing.h"
+#include "transport_profile.h"
+#include "wire_log.h"
+#include "timer_wheel.h"
+#include "busy_poll.h"
+#include "awaitable.h"
 
 
 class Client {
 public:
 
     Client() = default;
-    Client(std::function<void(std::string)> _callback, std::string _hostname, std::string _port) {
+    Client(std::function<void(std::string)> _callback, std::string _hostname, std::string _port, TransportProfile _profile = TransportProfile()) {
         callback = _callback;
         hostname = _hostname;
         port = _port;
+        profile = _profile;
         stop.store(false);
         initialized = true;
     }
@@ -27,6 +34,7 @@ public:
         
         hostname = client.hostname;
         port = client.port;
+        profile = client.profile;
         master_socket = client.master_socket;
         callback = std::move(client.callback);
         stop.store(false);
@@ -40,32 +48,111 @@ public:
     ~Client() {
         if (!stop.load()) 
             stop.store(true);
-        close(master_socket);
+        if (master_socket >= 0) close(master_socket);
     }
 
+    // whatever is still queued goes out first, then our end is closed; the
+    // loop reads on until the server closes its end too, so nothing it sent
+    // before is cut off and its connection slot is freed
     void shutdown() {
-        stop.store(true);
+        if (master_socket < 0) return;
+        sendQueue.drain(master_socket);
+        ::shutdown(master_socket, SHUT_WR);
+    }
+
+    // called on the client's thread when the server closes the connection
+    void setCloseCallback(std::function<void()> _onClose) {
+        onClose = _onClose;
     }
 
-    void message(std::string message) {
+    // queued in its lane if the socket cannot take it right away, see lanes.h
+    void message(std::string message, Lane lane = Lane::CONTROL) {
 
         #ifdef DEBUG
         std::cout << "Going to write the message " << message << " as client\n";
         #endif
-        status_t status = write(master_socket, message.c_str(), message.size()+1);
+        if (WireRecorder::instance().isRecording())
+            WireRecorder::instance().record(endpoint, 0, WireDirection::SENT, message);
+        uint64_t openedBatch = 0;
+        status_t status = sendQueue.send(master_socket, std::move(message), lane, &openedBatch);
+        if (openedBatch != 0) {
+            timers.scheduleAt(LoopTimers::Clock::now() + std::chrono::microseconds(profile.batchDelayUs), [this, openedBatch]() {
+                if (sendQueue.closeBatch(master_socket, openedBatch) != 0)
+                    std::cerr << "Error on write\n";
+            });
+            // the loop may be waiting on a later deadline
+            wakeup.wake();
+        }
+        if (sendQueue.hasPending()) wakeup.wake();
 
         #ifdef DEBUG
         std::cout << "Finished writing message, status " << status << '\n';
         #endif
 
-        if (status <= 0) {
+        if (status != 0) {
             std::cerr << "Error on write\n";
         }
     }
 
+    // runs callback on the client's thread at or soon after when, from any thread
+    TimerWheel::TimerId scheduleAt(LoopTimers::Clock::time_point when, TimerWheel::Callback callback) {
+        return timers.scheduleAt(when, std::move(callback));
+    }
+
+    bool cancel(TimerWheel::TimerId id) {
+        return timers.cancel(id);
+    }
+
     int start() {
         if (!initialized)
             throw std::runtime_error("Not initialized!");
+        prepare();
+        if (connectSocket() != 0)
+            return -1;
+
+        mainClientThread = std::thread(std::bind(&Client::main, this));
+        mainClientThread.detach();
+        #ifdef DEBUG
+        std::cout << "Main client thread started and detached, returning\n";
+        #endif
+        return 0;
+    }
+
+    // the next frame read goes to the awaiting coroutine instead of the
+    // callback; an empty frame if the server closes the connection first
+    Awaitable<std::string> receive() {
+        return Awaitable<std::string>([this](std::function<void(std::string)> onFrame) {
+            receivers.add(std::move(onFrame));
+        });
+    }
+
+    // start() without blocking the caller, see awaitable.h: the connection
+    // is tried on the client's own thread, which finishes with what start()
+    // would have returned and then goes on as the client's loop
+    Awaitable<int> connect() {
+        return Awaitable<int>([this](std::function<void(int)> onConnected) {
+            if (!initialized)
+                throw std::runtime_error("Not initialized!");
+            prepare();
+            mainClientThread = std::thread([this, onConnected]() {
+                status_t status = connectSocket();
+                onConnected(status);
+                if (status == 0) main();
+            });
+            mainClientThread.detach();
+        });
+    }
+
+private:
+    void prepare() {
+        endpoint = WireRecorder::instance().attach();
+        sendQueue.setBatchSize(batchRecords(profile));
+    }
+
+    // tries every connectRetryMs until connected or connectTimeoutMs has
+    // passed, both deadlines on the client's timers; a try that hangs, as
+    // to a host that drops the SYN, is cut off by the same deadline
+    int connectSocket() {
         status_t status;
         struct addrinfo host_info, *host_info_list;
         memset(&host_info, 0, sizeof(host_info));
@@ -79,78 +166,158 @@ public:
             return -1;
         }
 
-        master_socket = socket(host_info_list->ai_family,
-                               host_info_list->ai_socktype,
-                               host_info_list->ai_protocol);
-
-        if (master_socket == -1) {
-            std::cerr << "Error cannot create socket\n";
-            return -1;
-        }
-
-        int retries = 10;
-
+        bool timedOut = false, retryDue = true, inProgress = false;
+        TimerWheel::TimerId deadline = timers.scheduleAt(LoopTimers::Clock::now() + std::chrono::milliseconds(profile.connectTimeoutMs),
+            [&timedOut]() { timedOut = true; });
+        TimerWheel::TimerId retry = 0;
 
         #ifdef DEBUG
         std::cout << "Starting connection to " << host_info_list->ai_addr << "\n";
         #endif
-        while(retries--) {
-
-            #ifdef DEBUG
-            std::cout << "Right before connection: \n";
-            #endif
-            status = connect(master_socket, host_info_list->ai_addr, host_info_list->ai_addrlen);
-
-            #ifdef DEBUG
-            std::cout << "status of connection " << status << "\n";
-            std::cout << "Error message: " << strerror(errno) << '\n';
-            #endif
-
-            if (status == -1) std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            else break;
-            #ifdef DEBUG
-            std::cout << "unable to connect to " << host_info_list->ai_addr << ", retrying\n";
-            #endif
+        status = -1;
+        while (!timedOut && !stop.load()) {
+            if (retryDue) {
+                retryDue = false;
+                status = beginConnect(host_info_list, inProgress);
+                if (status == 0 && !inProgress) break;
+                if (status != 0) {
+                    // a socket or profile error will not go away by trying again
+                    if (master_socket < 0) break;
+                    closeSocket();
+                    retry = timers.scheduleAt(LoopTimers::Clock::now() + std::chrono::milliseconds(profile.connectRetryMs),
+                        [&retryDue]() { retryDue = true; });
+                }
+            }
+
+            fd_set writefds;
+            FD_ZERO(&writefds);
+            if (inProgress) FD_SET(master_socket, &writefds);
+            struct timeval tv = timers.timeout(std::chrono::microseconds(1000));
+            int ready = select(inProgress ? master_socket + 1 : 0, NULL, &writefds, NULL, &tv);
+            timers.run();
+
+            if (inProgress && ready > 0 && FD_ISSET(master_socket, &writefds)) {
+                inProgress = false;
+                int error = 0;
+                socklen_t length = sizeof(error);
+                if (getsockopt(master_socket, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+                    status = 0;
+                    break;
+                }
+                #ifdef DEBUG
+                std::cout << "unable to connect to " << host_info_list->ai_addr << ": " << strerror(error) << ", retrying\n";
+                #endif
+                status = -1;
+                closeSocket();
+                retry = timers.scheduleAt(LoopTimers::Clock::now() + std::chrono::milliseconds(profile.connectRetryMs),
+                    [&retryDue]() { retryDue = true; });
+            }
         }
+        // the callbacks point into this frame
+        timers.cancel(deadline);
+        timers.cancel(retry);
+        freeaddrinfo(host_info_list);
 
-        if (status == -1) {
+        if (status != 0 || inProgress) {
+            closeSocket();
             std::cerr << "Cannot connect to server\n";
             return -1;
         }
 
-        freeaddrinfo(host_info_list);
+        // the loop reads after select, as before
+        fcntl(master_socket, F_SETFL, fcntl(master_socket, F_GETFL) & ~O_NONBLOCK);
+        return 0;
+    }
 
-        mainClientThread = std::thread(std::bind(&Client::main, this));
-        mainClientThread.detach();
-        #ifdef DEBUG
-        std::cout << "Main client thread started and detached, returning\n";
-        #endif
+    // one try without blocking: 0 with inProgress set until the socket
+    // turns writable, 0 without it if connected at once, -1 otherwise
+    status_t beginConnect(struct addrinfo* address, bool& inProgress) {
+        inProgress = false;
+        master_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (master_socket == -1) {
+            std::cerr << "Error cannot create socket\n";
+            return -1;
+        }
+
+        if (applySocketProfile(master_socket, profile) != 0) {
+            closeSocket();
+            return -1;
+        }
+
+        fcntl(master_socket, F_SETFL, fcntl(master_socket, F_GETFL) | O_NONBLOCK);
+        if (::connect(master_socket, address->ai_addr, address->ai_addrlen) == 0)
+            return 0;
+        if (errno != EINPROGRESS)
+            return -1;
+        inProgress = true;
         return 0;
     }
 
-private:
+    void closeSocket() {
+        if (master_socket < 0) return;
+        close(master_socket);
+        master_socket = -1;
+    }
+
+    // closes the connection once nothing was read for idleTimeoutMs: the
+    // timer comes back when the last read would time out, so reads only
+    // stamp the time and never touch the wheel
+    void checkIdle() {
+        if (master_socket < 0) return;
+        LoopTimers::Clock::time_point idleAt = lastRead + std::chrono::milliseconds(profile.idleTimeoutMs);
+        if (LoopTimers::Clock::now() < idleAt) {
+            timers.scheduleAt(idleAt, [this]() { checkIdle(); });
+            return;
+        }
+        std::cerr << "Nothing read from the server for " << profile.idleTimeoutMs << " ms, closing the connection\n";
+        // the loop reads the end of the stream and closes as if the server had
+        ::shutdown(master_socket, SHUT_RDWR);
+    }
+
     void main() {
-        fd_set readfds;
+        fd_set readfds, writefds;
+        PinnedThread pinned;
+        SpinBudget spin(profile.spinUs);
+        lastRead = LoopTimers::Clock::now();
+        if (profile.idleTimeoutMs > 0) checkIdle();
 
         while(!stop.load()) {
             FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
             FD_SET(master_socket, &readfds);
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 1000;
+            FD_SET(wakeup.fd(), &readfds);
+            if (sendQueue.hasPending()) FD_SET(master_socket, &writefds);
+            struct timeval tv = spin.timeout(timers.timeout(std::chrono::microseconds(1000)));
+
+            spin.onSelect(select(std::max(master_socket, wakeup.fd())+1, &readfds, &writefds, NULL, &tv));
+            timers.run();
+
+            if (FD_ISSET(wakeup.fd(), &readfds)) wakeup.clear();
 
-            select(master_socket+1, &readfds, NULL, NULL, &tv);
+            if (FD_ISSET(master_socket, &writefds) && sendQueue.flush(master_socket) != 0)
+                std::cerr << "Error on write\n";
 
             if (FD_ISSET(master_socket, &readfds)) {
-                status_t amount_read = read(master_socket, buffer, BUFFER_SIZE);
+                status_t amount_read = reader.readFrom(master_socket, buffer, BUFFER_SIZE,
+                    [this](std::string frame, Lane lane) {
+                        received.add(0, std::move(frame), lane);
+                    });
+                received.dispatch([this](size_t, std::string frame) {
+                    if (WireRecorder::instance().isRecording())
+                        WireRecorder::instance().record(endpoint, 0, WireDirection::RECEIVED, frame);
+                    if (!receivers.offer(frame)) callback(std::move(frame));
+                });
                 if (amount_read == 0) {
                     close(master_socket);
+                    master_socket = -1;
+                    receivers.finishAll(std::string());
+                    if (onClose) onClose();
                     return;
                 } else if (amount_read == -1) {
                     if (stop.load()) break;
                 } else {
-                    buffer[amount_read] = '\0';
-                    callback(std::string(buffer));
+                    lastRead = LoopTimers::Clock::now();
+                    rearmAfterRead(master_socket, profile);
                 }
             } else if (stop.load()) {
                 break;
@@ -158,10 +325,20 @@ private:
         }
     }
     std::string hostname, port;
-    socketfd_t master_socket;
+    TransportProfile profile;
+    socketfd_t master_socket = -1;
     std::function<void(std::string)> callback;
+    std::function<void()> onClose;
     std::atomic<bool> stop;
-    char buffer[BUFFER_SIZE+1];
+    char buffer[BUFFER_SIZE];
+    FrameReader reader;
+    SendQueue sendQueue;
+    LoopWakeup wakeup;
+    LaneDispatcher<size_t> received;
+    Waiters<std::string> receivers;
+    uint32_t endpoint = 0;
+    LoopTimers timers;
+    LoopTimers::Clock::time_point lastRead;
     std::thread mainClientThread;
     bool initialized = false;
 };
@@ -3,44 +3,151 @@
 
 #include "client.h"
 #include "server.h"
+#include "trace.h"
+#include "id_parse.h"
+#include "routing.h"
 #include <string>
 #include <iostream>
 #include <sstream>
 
 #define TOKEN_DELIM '_'
 #define VECTOR_DELIM ','
+#define PAYLOAD_MARK '#'
+
+constexpr static size_t AUTHOR_WIDTH = 11;
+constexpr static size_t HOPS_WIDTH = 20;
+constexpr static size_t POTATO_ID_WIDTH = 20;
+// potato ids are epoch * POTATO_EPOCH_STRIDE + index, see Ringmaster_Resume
+constexpr static size_t POTATO_EPOCH_STRIDE = 1000000000000ull;
 
 /*
 Command conventions:
 
+author is zero padded to AUTHOR_WIDTH characters, so a forwarding player
+can rewrite it in place
+
+A packet may carry an opaque binary payload, sent ahead of the text part as
+    #<payload length>#<payload bytes>author_type_args...
+
+Give_Potato and Player_Unlink travel in the data lane, everything else in
+the control lane, see lanes.h and laneOf
+
 PlayerRegister:
     player id is by default 69420
     Args: None
 
 PlayerReady:
-    Args: None
+    Args: [players ready]: size_t - string, in tree mode the size of the
+                           sender's subtree, all of which is ready; 1 if absent
+    In an elastic game it is sent again whenever a Ringmaster_Set_Next mid
+    game has been carried out.
 
 Player_Report_Addr:
     Args: IP: string - string
           port: string - string
 
 Give_Potato:
-    Args: num hops left: string - string
+    Args: num hops left: string - string, zero padded to HOPS_WIDTH
+          potato id: size_t - string, zero padded to POTATO_ID_WIDTH, tells
+                     apart potatoes in flight at the same time
+          sender load: size_t - string, zero padded to LOAD_WIDTH, potatoes
+                       queued at the sender as it sent this one, see routing.h
+          received: size_t - string, zero padded to LOAD_WIDTH, potatoes the
+                    sender got from the receiver so far, mod LOAD_MODULUS
           history: vector<int> - string
+          [direction trace]: DirectionTrace - string, only in DIRECTION_BITS
+                             trace mode, history is then left empty
+
+    The growing trace is always the last field, see PotatoFrame.
+
+Player_Hello:
+    sent by a player to next right after connecting, so next knows which of
+    its connections is its prev
+    Args: [ring version]: size_t - string, of the Ringmaster_Set_Next that
+                          made the connection; next ignores a hello older
+                          than the one of its current prev. 0 if absent
 
 Ringmaster_Set_Next:
     Args: next id: size_t - string
           next hostname: string - string
           next port: string - string
+          [ring version]: size_t - string, counts the ring changes of an
+                          elastic game, 0 if absent
 
 Ringmaster_Assign_Id_Port:
     Args: player id: size_t - string
-          player port: string - string
+          player port: string - string, "0" lets the player bind any free
+                       port, it reports the one it got in Player_Report_Addr
           prev id: size_t - string
           tot_players: size_t - string
+          [checkpoint hops]: size_t - string, report the potato with a
+                             Potato_Checkpoint whenever it arrives with a
+                             multiple of this many hops left; 0 if absent
+          [routing]: string - string, random or load, see routing.h;
+                     random if absent
+
+Ringmaster_Set_Tree:
+    sent instead of Ringmaster_Set_Next in tree mode, to the first player of
+    a range of players, who relays it to its own children (see splitRange)
+    Args: fanout: size_t - string
+          range start: size_t - string, the receiving player
+          range end: size_t - string, exclusive
+          addresses: hostname and port of every player from range start up
+                     to and including range end (mod players), the last one
+                     being the next player of the range's last player
 
 Ringmaster_Shutdown:
     Args: None
+    In tree mode it is relayed down the same tree.
+
+Potato_Checkpoint:
+    a copy of a potato as it arrived at the author, without the payload
+    Args: same as Give_Potato
+
+Player_Rejoin:
+    sent by a player that reconnected to a restarted ringmaster
+    Args: player id: size_t - string
+
+Ringmaster_Resume:
+    sent to every player once all of them rejoined, players drop potatoes of
+    older epochs from then on, as the ringmaster resends them from the last
+    checkpoint
+    Args: epoch: size_t - string
+
+Player_Leave:
+    asks to leave an elastic game, the ringmaster then moves the sender's
+    prev on to the sender's next
+    Args: None
+
+Player_Unlink:
+    sent to a neighbour over the connection to it once nothing more will be
+    sent on that connection, so a leaving player knows when the potatoes
+    still coming its way have all arrived; in the data lane so it cannot
+    overtake them
+    Args: None
+
+The ringmasters of a federated game talk over their own connections, see
+federation.h; a potato that ends in a segment other than the lead's is sent
+on to the lead as the Give_Potato the segment got
+
+Segment_Head:
+    sent to the lead by a ringmaster whose players all reported their
+    address, and by the lead to each segment once it has every head, with
+    the head of the segment after it
+    Args: segment: size_t - string
+          player id: size_t - string, of the segment's first player
+          hostname: string - string
+          port: string - string
+
+Segment_Ready:
+    sent to the lead by a ringmaster whose players are all ready
+    Args: segment: size_t - string
+
+Segment_Potato:
+    sent by the lead to the ringmaster of the player a potato starts at, in
+    the data lane; carries the potato's payload
+    Args: player id: size_t - string
+          the Give_Potato args
 */
 
 enum class CommandType {
@@ -51,8 +158,43 @@ enum class CommandType {
     RINGMASTER_SET_NEXT = 5,
     RINGMASTER_ASSIGN_ID_PORT = 6,
     RINGMASTER_SHUTDOWN = 7,
+    PLAYER_HELLO = 8,
+    RINGMASTER_SET_TREE = 9,
+    POTATO_CHECKPOINT = 10,
+    PLAYER_REJOIN = 11,
+    RINGMASTER_RESUME = 12,
+    PLAYER_LEAVE = 13,
+    PLAYER_UNLINK = 14,
+    SEGMENT_HEAD = 15,
+    SEGMENT_READY = 16,
+    SEGMENT_POTATO = 17,
 };
 
+// the lane a command is sent and handled in
+Lane laneOf(CommandType commandType) {
+    if (commandType == CommandType::GIVE_POTATO || commandType == CommandType::PLAYER_UNLINK
+        || commandType == CommandType::SEGMENT_POTATO)
+        return Lane::DATA;
+    return Lane::CONTROL;
+}
+
+// Tree mode lays the players out as a tree over contiguous id ranges: a node
+// heading [start, end) has children heading the ranges of splitRange(start + 1,
+// end, fanout), and the ringmaster heads the ranges of splitRange(0, players,
+// fanout). Every subtree is a contiguous range, so a node only needs the
+// addresses of its own range.
+std::vector<std::pair<size_t, size_t>> splitRange(size_t start, size_t end, size_t fanout) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t size = end - start;
+    size_t parts = std::min(fanout, size);
+    for(size_t i = 0; i < parts; i++) {
+        size_t partStart = start + size * i / parts;
+        size_t partEnd = start + size * (i + 1) / parts;
+        ranges.emplace_back(partStart, partEnd);
+    }
+    return ranges;
+}
+
 std::vector<std::string> split(const std::string& str, char delimiter) {
     std::vector<std::string> tokens;
     std::stringstream ss(str);
@@ -90,14 +232,16 @@ std::string serialize_vector(const std::vector<size_t>& ids, char delimiter) {
     return oss.str();
 }
 
+// appends the ids in str to ids, so a caller can parse into a reused vector
+void deserialize_vector(const std::string& str, char delimiter, std::vector<size_t>& ids) {
+    static const IdParser parser = selectIdParser();
+    if (str.empty()) return;
+    parser(str.data(), str.size(), delimiter, ids);
+}
+
 std::vector<size_t> deserialize_vector(const std::string& str, char delimiter) {
-    if (str.empty()) return {};
     std::vector<size_t> ids;
-    std::istringstream iss(str);
-    std::string token;
-    while (std::getline(iss, token, delimiter)) {
-        ids.push_back(std::stoull(token));
-    }
+    deserialize_vector(str, delimiter, ids);
     return ids;
 }
 
@@ -105,21 +249,38 @@ struct CommandPacket {
     int author;
     CommandType commandType;
     std::vector<std::string> commandArgs;
+    std::string payload;
 
     std::string serialize() {
         std::vector<std::string> tokens;
 
         tokens.resize(2 + commandArgs.size());
-        tokens[0] = std::to_string(author);
+        tokens[0] = fixedWidth((long long) author, AUTHOR_WIDTH);
         tokens[1] = std::to_string((int) commandType);
         copy(commandArgs.begin(), commandArgs.end(), tokens.begin()+2);
 
-        return concatenate(tokens, TOKEN_DELIM);
+        if (payload.empty())
+            return concatenate(tokens, TOKEN_DELIM);
+
+        std::string str;
+        str += PAYLOAD_MARK;
+        str += std::to_string(payload.size());
+        str += PAYLOAD_MARK;
+        str += payload;
+        str += concatenate(tokens, TOKEN_DELIM);
+        return str;
     }
 
     static CommandPacket deserialize(std::string str) {
         CommandPacket packet;
 
+        size_t payloadStart = 0;
+        size_t textStart = textOffset(str, &payloadStart);
+        if (textStart > 0) {
+            packet.payload = str.substr(payloadStart, textStart - payloadStart);
+            str.erase(0, textStart);
+        }
+
         std::vector<std::string> tokens = split(str, TOKEN_DELIM);
 
         packet.author = stoi(tokens[0]);
@@ -128,20 +289,60 @@ struct CommandPacket {
 
         return packet;
     }
+
+    // where the text part of a serialized packet starts, after the optional payload
+    static size_t textOffset(const std::string& str, size_t* payloadStart = nullptr) {
+        if (str.empty() || str[0] != PAYLOAD_MARK) return 0;
+
+        size_t lengthEnd = str.find(PAYLOAD_MARK, 1);
+        if (lengthEnd == std::string::npos)
+            throw std::runtime_error("Malformed payload header");
+        size_t length = std::stoull(str.substr(1, lengthEnd - 1));
+        if (lengthEnd + 1 + length > str.size())
+            throw std::runtime_error("Payload longer than the packet");
+
+        if (payloadStart != nullptr) *payloadStart = lengthEnd + 1;
+        return lengthEnd + 1 + length;
+    }
 };
 
+// FNV-1a, used to check a payload came back unchanged
+uint64_t payloadChecksum(const std::string& payload) {
+    uint64_t hash = 14695981039346656037ull;
+    for(unsigned char c: payload) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 // Give_Potato:
 //     Args: num hops left: string - string
+//           potato id: size_t - string
+//           sender load: size_t - string
+//           received: size_t - string
 //           history: vector<int> - string
+//           [direction trace]: DirectionTrace - string
 
 struct Potato {
     size_t numHops;
+    size_t potatoId = 0;
+    size_t senderLoad = 0, received = 0;
     std::vector<size_t> ids;
+    TraceMode traceMode = TraceMode::IDS;
+    DirectionTrace directions;
 
     static Potato parsePotato(const std::vector<std::string>& args) {
         Potato potato;
-        potato.numHops = stoi(args[0]);
-        potato.ids = deserialize_vector(args[1], VECTOR_DELIM);
+        potato.numHops = stoull(args[0]);
+        potato.potatoId = stoull(args[1]);
+        potato.senderLoad = stoull(args[2]);
+        potato.received = stoull(args[3]);
+        deserialize_vector(args[4], VECTOR_DELIM, potato.ids);
+        if (args.size() > 5) {
+            potato.traceMode = TraceMode::DIRECTION_BITS;
+            potato.directions = DirectionTrace::deserialize(args[5]);
+        }
 
         return potato;
     }
@@ -149,12 +350,183 @@ struct Potato {
     std::vector<std::string> serialize_to_vec() {
         std::vector<std::string> potatoSerialized;
 
-        potatoSerialized.push_back(std::to_string(numHops));
+        potatoSerialized.push_back(fixedWidth(numHops, HOPS_WIDTH));
+        potatoSerialized.push_back(fixedWidth(potatoId, POTATO_ID_WIDTH));
+        potatoSerialized.push_back(fixedWidth(std::min(senderLoad, LOAD_MODULUS - 1), LOAD_WIDTH));
+        potatoSerialized.push_back(fixedWidth(received % LOAD_MODULUS, LOAD_WIDTH));
         potatoSerialized.push_back(serialize_vector(ids, VECTOR_DELIM));
+        if (traceMode == TraceMode::DIRECTION_BITS)
+            potatoSerialized.push_back(directions.serialize());
 
         return potatoSerialized;
     }
 
+    // record that the holder passed the potato on to its neighbourIdx-th neighbour
+    void recordHop(size_t holderId, size_t neighbourIdx) {
+        if (traceMode == TraceMode::DIRECTION_BITS)
+            directions.append(neighbourIdx);
+        else
+            ids.push_back(holderId);
+    }
+
+    // record that the holder is the last one, the potato goes back to the ringmaster
+    void recordLastHop(size_t holderId) {
+        if (traceMode == TraceMode::IDS)
+            ids.push_back(holderId);
+    }
+
+    size_t numHolders() const {
+        if (traceMode == TraceMode::DIRECTION_BITS) return directions.numSymbols + 1;
+        return ids.size();
+    }
+
+    // visits every holder in order, resolve(id, neighbourIdx) maps direction
+    // symbols back to ids
+    template<typename Resolve, typename Visit>
+    void forEachHolder(Resolve resolve, Visit visit) const {
+        if (traceMode == TraceMode::DIRECTION_BITS)
+            directions.expand(resolve, visit);
+        else
+            for(auto id: ids) visit(id);
+    }
+
+};
+
+// Cut-through view of a serialized Give_Potato packet. A forwarding player
+// rewrites the author and hop count in place and appends its hop to the end
+// of the frame, so the trace is never parsed or re-encoded. A hop still
+// costs O(frame): FrameReader copies the frame out of the read buffer, and
+// the kernel copies it on send and on receive.
+//
+// Layout: [payload]author(AUTHOR_WIDTH)_4_hops(HOPS_WIDTH)_potatoId(POTATO_ID_WIDTH)_load(LOAD_WIDTH)_received(LOAD_WIDTH)_history[_direction trace]
+// The payload is carried along untouched.
+class PotatoFrame {
+public:
+
+    // false for anything that is not a potato in the fixed width layout,
+    // those go through the regular CommandPacket path
+    static bool matches(const std::string& frame) {
+        size_t base = CommandPacket::textOffset(frame);
+        return frame.size() >= base + HISTORY_OFFSET
+            && frame[base + AUTHOR_WIDTH] == TOKEN_DELIM
+            && frame[base + TYPE_OFFSET] == '0' + (int) CommandType::GIVE_POTATO
+            && frame[base + TYPE_OFFSET + 1] == TOKEN_DELIM
+            && frame[base + HOPS_END] == TOKEN_DELIM
+            && frame[base + LOAD_OFFSET - 1] == TOKEN_DELIM
+            && frame[base + RECEIVED_OFFSET - 1] == TOKEN_DELIM
+            && frame[base + HISTORY_OFFSET - 1] == TOKEN_DELIM;
+    }
+
+    explicit PotatoFrame(std::string& _frame) : frame(_frame) {
+        base = CommandPacket::textOffset(frame);
+        // an empty history followed by another field means a direction trace
+        directionBits = frame.size() > base + HISTORY_OFFSET && frame[base + HISTORY_OFFSET] == TOKEN_DELIM;
+        if (directionBits) {
+            size_t startEnd = frame.find(',', base + TRACE_OFFSET);
+            size_t bitsEnd = frame.find(',', startEnd + 1);
+            if (startEnd == std::string::npos || bitsEnd == std::string::npos)
+                throw std::runtime_error("Malformed direction trace");
+            bitsPerHop = std::stoull(frame.substr(startEnd + 1, bitsEnd - startEnd - 1));
+            symbolsOffset = bitsEnd + 1;
+            if (frame.size() <= symbolsOffset + DirectionTrace::NUM_SYMBOLS_WIDTH)
+                throw std::runtime_error("Malformed direction trace");
+        }
+    }
+
+    size_t potatoId() const {
+        return parseFixed(base + POTATO_ID_OFFSET, POTATO_ID_WIDTH);
+    }
+
+    size_t numHops() const {
+        return parseFixed(base + HOPS_OFFSET, HOPS_WIDTH);
+    }
+
+    void setNumHops(size_t numHops) {
+        patch(base + HOPS_OFFSET, fixedWidth(numHops, HOPS_WIDTH));
+    }
+
+    void setAuthor(int author) {
+        patch(base, fixedWidth((long long) author, AUTHOR_WIDTH));
+    }
+
+    int author() const {
+        return std::stoi(frame.substr(base, AUTHOR_WIDTH));
+    }
+
+    size_t senderLoad() const {
+        return parseFixed(base + LOAD_OFFSET, LOAD_WIDTH);
+    }
+
+    void setSenderLoad(size_t load) {
+        patch(base + LOAD_OFFSET, fixedWidth(std::min(load, LOAD_MODULUS - 1), LOAD_WIDTH));
+    }
+
+    size_t received() const {
+        return parseFixed(base + RECEIVED_OFFSET, LOAD_WIDTH);
+    }
+
+    void setReceived(size_t received) {
+        patch(base + RECEIVED_OFFSET, fixedWidth(received % LOAD_MODULUS, LOAD_WIDTH));
+    }
+
+    void recordHop(size_t holderId, size_t neighbourIdx) {
+        if (directionBits) {
+            size_t numSymbols = parseFixed(symbolsOffset, DirectionTrace::NUM_SYMBOLS_WIDTH);
+            DirectionTrace::appendSymbol(frame, numSymbols, bitsPerHop, neighbourIdx);
+            patch(symbolsOffset, fixedWidth(numSymbols + 1, DirectionTrace::NUM_SYMBOLS_WIDTH));
+        } else {
+            appendId(holderId);
+        }
+    }
+
+    void recordLastHop(size_t holderId) {
+        if (!directionBits)
+            appendId(holderId);
+    }
+
+    // the potato as a Potato_Checkpoint from holder, call before changing it
+    std::string checkpoint(int holder) const {
+        std::string packet = fixedWidth((long long) holder, AUTHOR_WIDTH);
+        packet += TOKEN_DELIM;
+        packet += std::to_string((int) CommandType::POTATO_CHECKPOINT);
+        packet += TOKEN_DELIM;
+        packet.append(frame, base + HOPS_OFFSET, std::string::npos);
+        return packet;
+    }
+
+private:
+    void appendId(size_t holderId) {
+        if (frame.size() > base + HISTORY_OFFSET) frame.push_back(VECTOR_DELIM);
+        frame += std::to_string(holderId);
+    }
+
+    size_t parseFixed(size_t offset, size_t width) const {
+        size_t value = 0;
+        for(size_t i = offset; i < offset + width; i++) {
+            if (frame[i] < '0' || frame[i] > '9')
+                throw std::runtime_error("Malformed fixed width field in potato");
+            value = value * 10 + (frame[i] - '0');
+        }
+        return value;
+    }
+
+    void patch(size_t offset, const std::string& field) {
+        frame.replace(offset, field.size(), field);
+    }
+
+    constexpr static size_t TYPE_OFFSET = AUTHOR_WIDTH + 1;
+    constexpr static size_t HOPS_OFFSET = TYPE_OFFSET + 2;
+    constexpr static size_t HOPS_END = HOPS_OFFSET + HOPS_WIDTH;
+    constexpr static size_t POTATO_ID_OFFSET = HOPS_END + 1;
+    constexpr static size_t LOAD_OFFSET = POTATO_ID_OFFSET + POTATO_ID_WIDTH + 1;
+    constexpr static size_t RECEIVED_OFFSET = LOAD_OFFSET + LOAD_WIDTH + 1;
+    constexpr static size_t HISTORY_OFFSET = RECEIVED_OFFSET + LOAD_WIDTH + 1;
+    constexpr static size_t TRACE_OFFSET = HISTORY_OFFSET + 1;
+
+    std::string& frame;
+    size_t base = 0;
+    bool directionBits = false;
+    size_t bitsPerHop = 1, symbolsOffset = 0;
 };
 
 #endif
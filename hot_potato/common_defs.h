@@ -21,52 +21,120 @@
 #include <netdb.h>
 #include <thread>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <ifaddrs.h>
+#include <net/if.h>
 
 using socketfd_t = int;
 using status_t = int;
 
-constexpr static size_t BUFFER_SIZE = 2048;
+// read chunk size, frames larger than this are read straight into their own buffer
+constexpr static size_t BUFFER_SIZE = 65536;
 
-std::string getLocalIP() {
-    const char* googleDnsIp = "8.8.8.8";
-    uint16_t dnsPort = 53;
-    struct sockaddr_in serv;
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+// zero padded decimal, the sign (if any) counts towards the width
+std::string fixedWidth(long long value, size_t width) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%0*lld", (int) width, value);
+    return std::string(buffer);
+}
 
-    // Could not create socket
-    if (sock < 0) {
-        std::cerr << "Socket error" << std::endl;
-        return "Error";
+std::string fixedWidth(size_t value, size_t width) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%0*zu", (int) width, value);
+    return std::string(buffer);
+}
+
+// parses trailing "--name value" pairs of the command line, starting at argv[first]
+std::map<std::string, std::string> parseFlags(int argc, char* argv[], int first) {
+    std::map<std::string, std::string> flags;
+    for(int i = first; i < argc; i += 2) {
+        std::string name(argv[i]);
+        if (name.size() < 3 || name.compare(0, 2, "--") != 0 || i + 1 >= argc)
+            throw std::runtime_error("Malformed flag " + name);
+        flags[name.substr(2)] = argv[i+1];
+    }
+    return flags;
+}
+
+// (ip, port) of an IPv4 or IPv6 socket address
+std::pair<std::string, std::string> describeAddress(const sockaddr_storage& addr) {
+    char ipStr[INET6_ADDRSTRLEN];
+    const void* ip;
+    uint16_t port;
+    if (addr.ss_family == AF_INET6) {
+        ip = &((const sockaddr_in6*) &addr)->sin6_addr;
+        port = ((const sockaddr_in6*) &addr)->sin6_port;
+    } else {
+        ip = &((const sockaddr_in*) &addr)->sin_addr;
+        port = ((const sockaddr_in*) &addr)->sin_port;
     }
 
-    memset(&serv, 0, sizeof(serv));
-    serv.sin_family = AF_INET;
-    serv.sin_addr.s_addr = inet_addr(googleDnsIp);
-    serv.sin_port = htons(dnsPort);
+    if (inet_ntop(addr.ss_family, ip, ipStr, sizeof(ipStr)) == nullptr) {
+        throw std::runtime_error("Failed to convert IP address to string: " + std::string(strerror(errno)));
+    }
 
-    int err = connect(sock, (const sockaddr*)&serv, sizeof(serv));
-    if (err < 0) {
-        std::cerr << "Error connecting" << std::endl;
-        close(sock);
+    return {ipStr, std::to_string(ntohs(port))};
+}
+
+// Address of this host as seen by other players, found by walking the
+// interfaces with getifaddrs, so no packet has to leave the box.
+// preferredInterface (if set and present) wins, then up non-loopback
+// interfaces, and loopback is the last resort so a host without any network
+// still works. The answer is cached per process, a fleet of players in one
+// process pays for the lookup once.
+std::string getLocalIP(const std::string& preferredInterface = "", int family = AF_INET) {
+    static std::mutex cacheLock;
+    static std::map<std::pair<std::string, int>, std::string> cache;
+
+    std::unique_lock<std::mutex> lock(cacheLock);
+    auto cached = cache.find({preferredInterface, family});
+    if (cached != cache.end()) return cached->second;
+
+    struct ifaddrs* interfaces;
+    if (getifaddrs(&interfaces) != 0) {
+        std::cerr << "Error listing network interfaces: " << strerror(errno) << std::endl;
         return "Error";
     }
 
-    sockaddr_in name;
-    socklen_t namelen = sizeof(name);
-    err = getsockname(sock, (sockaddr*)&name, &namelen);
+    // lower rank is better
+    int bestRank = 4;
+    std::string best;
+    for(struct ifaddrs* cur = interfaces; cur != nullptr; cur = cur->ifa_next) {
+        if (cur->ifa_addr == nullptr || cur->ifa_addr->sa_family != family) continue;
+        if (!(cur->ifa_flags & IFF_UP)) continue;
 
-    char buffer[80];
-    const char* p = inet_ntop(AF_INET, &name.sin_addr, buffer, 80);
-    if (p != nullptr) {
-        std::string localIP(p);
-        close(sock);
-        return localIP;
-    } else {
-        // Error handling
+        char buffer[INET6_ADDRSTRLEN];
+        const void* addr;
+        if (family == AF_INET6) {
+            const sockaddr_in6* addr6 = (const sockaddr_in6*) cur->ifa_addr;
+            // link local addresses need a scope id to be of use to peers
+            if (IN6_IS_ADDR_LINKLOCAL(&addr6->sin6_addr)) continue;
+            addr = &addr6->sin6_addr;
+        } else {
+            addr = &((const sockaddr_in*) cur->ifa_addr)->sin_addr;
+        }
+        if (inet_ntop(family, addr, buffer, sizeof(buffer)) == nullptr) continue;
+
+        int rank;
+        if (!preferredInterface.empty() && preferredInterface == cur->ifa_name) rank = 0;
+        else if (cur->ifa_flags & IFF_LOOPBACK) rank = 3;
+        else rank = 1;
+
+        if (rank < bestRank) {
+            bestRank = rank;
+            best = buffer;
+        }
+    }
+    freeifaddrs(interfaces);
+
+    if (best.empty()) {
         std::cerr << "Could not get local IP address" << std::endl;
-        close(sock);
         return "Error";
     }
+
+    cache[{preferredInterface, family}] = best;
+    return best;
 }
 #endif
 
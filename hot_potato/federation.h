@@ -0,0 +1,60 @@
+#ifndef FEDERATION
+#define FEDERATION
+
+#include "common_defs.h"
+#include "commands.h"
+#include <stdexcept>
+
+constexpr static size_t MAX_SEGMENTS = 64;
+
+/*
+A federated game is one ring coordinated by several ringmasters, each
+registering, wiring and shutting down a contiguous segment of the player
+ids (segment i of k is splitRange(0, players, k)[i]). Segment 0 is the lead,
+it listens on the federation address and the others connect to it:
+
+    wiring      once all players of a segment reported their address, its
+                ringmaster sends the lead its head, the first player; with
+                every head in the lead sends each segment the head of the
+                one after it, and the segment's last player is pointed there
+    readiness   a segment whose players are all ready tells the lead, which
+                starts the game once every segment is
+    potatoes    the lead picks the starting players of the whole ring and
+                hands a potato starting elsewhere to that segment's
+                ringmaster; a potato ending in a segment is sent on to the
+                lead, which keeps the one trace of the game
+    shutdown    the lead tells every segment, each its own players
+
+Players connect to their segment's ringmaster and do not know about the
+others, the stitch between segments is an ordinary link between neighbours.
+*/
+
+// "1/4" to segment 1 of 4
+std::pair<size_t, size_t> parseSegment(const std::string& str) {
+    size_t slash = str.find('/');
+    if (slash == std::string::npos)
+        throw std::runtime_error("Segment " + str + " is not <index>/<segments>");
+    size_t segment = std::stoull(str.substr(0, slash));
+    size_t numSegments = std::stoull(str.substr(slash + 1));
+    if (numSegments == 0 || segment >= numSegments)
+        throw std::runtime_error("Segment " + str + " is out of range");
+    return {segment, numSegments};
+}
+
+// "host:port" to (host, port), the last colon splits so an IPv6 host works
+std::pair<std::string, std::string> parseHostPort(const std::string& str) {
+    size_t colon = str.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == str.size())
+        throw std::runtime_error("Address " + str + " is not <host>:<port>");
+    return {str.substr(0, colon), str.substr(colon + 1)};
+}
+
+// the segment of a player id
+size_t segmentOf(size_t playerId, size_t numPlayers, size_t numSegments) {
+    std::vector<std::pair<size_t, size_t>> ranges = splitRange(0, numPlayers, numSegments);
+    for(size_t segment = 0; segment < ranges.size(); segment++)
+        if (playerId < ranges[segment].second) return segment;
+    throw std::runtime_error("Player id " + std::to_string(playerId) + " is out of range");
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef FRAMING
+#define FRAMING
+
+#include "common_defs.h"
+#include "lanes.h"
+#include <deque>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+/*
+Transport framing:
+
+Every message is sent as a 4 byte big endian body length followed by the
+body, so messages of any size (up to MAX_FRAME_SIZE) can be sent and
+several messages arriving in one read are told apart. The top bit of the
+length is set for frames in the data lane.
+
+The next bit marks a batch: its body is several messages, each again a 4
+byte length followed by the message, and the reader hands them on one by
+one. Batching is opt-in per connection, see TransportProfile.
+*/
+
+constexpr static size_t FRAME_HEADER_SIZE = 4;
+constexpr static size_t MAX_FRAME_SIZE = ((size_t) 1 << 30) - 1;
+// set in the length of a frame in the data lane, see lanes.h
+constexpr static uint32_t DATA_LANE_BIT = (uint32_t) 1 << 31;
+constexpr static uint32_t BATCH_BIT = (uint32_t) 1 << 30;
+
+// appends message to a batch body
+void appendBatchRecord(std::string& batch, const std::string& message) {
+    uint32_t length = htonl((uint32_t) message.size());
+    batch.append((const char*) &length, FRAME_HEADER_SIZE);
+    batch.append(message);
+}
+
+// A frame on its way out, header included
+struct OutgoingFrame {
+    uint32_t header = 0;
+    std::string body;
+    // bytes of header and body written so far
+    size_t written = 0;
+
+    OutgoingFrame() = default;
+    OutgoingFrame(std::string _body, Lane lane, bool batch = false) {
+        body = std::move(_body);
+        uint32_t length = (uint32_t) body.size();
+        if (lane == Lane::DATA) length |= DATA_LANE_BIT;
+        if (batch) length |= BATCH_BIT;
+        header = htonl(length);
+    }
+
+    // writes what the socket takes, without blocking unless flags say so;
+    // returns 1 once the whole frame is written, 0 if the socket is full and
+    // -1 on error
+    int writeTo(socketfd_t fd, int flags) {
+        while (true) {
+            struct iovec parts[2];
+            int numParts = 0;
+            if (written < FRAME_HEADER_SIZE) {
+                parts[numParts].iov_base = (char*) &header + written;
+                parts[numParts].iov_len = FRAME_HEADER_SIZE - written;
+                numParts++;
+            }
+            size_t bodyWritten = written > FRAME_HEADER_SIZE ? written - FRAME_HEADER_SIZE : 0;
+            if (bodyWritten < body.size()) {
+                parts[numParts].iov_base = (void*) (body.data() + bodyWritten);
+                parts[numParts].iov_len = body.size() - bodyWritten;
+                numParts++;
+            }
+            if (numParts == 0) return 1;
+
+            // a peer that went away is an error on write, not a SIGPIPE
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = parts;
+            message.msg_iovlen = numParts;
+            ssize_t status = sendmsg(fd, &message, flags | MSG_NOSIGNAL);
+            if (status < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            written += status;
+        }
+    }
+};
+
+// Lets other threads cut an event loop's select short: the loop selects on
+// fd() for reading and calls clear() when it is readable.
+class LoopWakeup {
+public:
+
+    LoopWakeup() {
+        if (pipe(fds) != 0)
+            throw std::runtime_error("Cannot create wakeup pipe: " + std::string(strerror(errno)));
+        for(int fd: fds) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~LoopWakeup() {
+        for(int fd: fds) close(fd);
+    }
+
+    int fd() const {
+        return fds[0];
+    }
+
+    void wake() {
+        if (signalled.exchange(true)) return;
+        char byte = 0;
+        if (write(fds[1], &byte, 1) < 0 && errno != EAGAIN)
+            std::cerr << "Error: cannot wake event loop\n";
+    }
+
+    // a wake from here on writes again, whatever it was for is looked at after clear
+    void clear() {
+        char bytes[64];
+        while (read(fds[0], bytes, sizeof(bytes)) > 0) {}
+        signalled.store(false);
+    }
+
+private:
+    int fds[2];
+    std::atomic<bool> signalled{false};
+};
+
+// Frames waiting to go out on one socket, a queue per lane. Any thread may
+// send; a frame goes straight out if nothing is queued ahead of it and the
+// socket takes it, otherwise it waits for flush, which the event loop calls
+// once the socket is writable again (wake the loop if send leaves frames
+// queued). So a writer never blocks on a peer that is slow to read, and
+// control frames skip the potatoes queued behind a full socket.
+//
+// With batching on, data lane messages are collected into a batch instead,
+// which is queued as one frame once it holds batchSize of them or when the
+// owner closes it, whichever comes first.
+class SendQueue {
+public:
+
+    // at most maxRecords messages to a batch, 0 or 1 turns batching off
+    void setBatchSize(size_t maxRecords) {
+        std::unique_lock<std::mutex> lock(queueLock);
+        batchSize = maxRecords;
+    }
+
+    // returns 0, or -1 if the connection failed; openedBatch is set to the id
+    // of the batch body started, if it started one, for closeBatch
+    status_t send(socketfd_t fd, std::string body, Lane lane, uint64_t* openedBatch = nullptr) {
+        if (body.size() > MAX_FRAME_SIZE) {
+            std::cerr << "Error: frame of " << body.size() << " bytes is too large\n";
+            return -1;
+        }
+        std::unique_lock<std::mutex> lock(queueLock);
+        if (batchSize > 1 && lane == Lane::DATA && body.size() + FRAME_HEADER_SIZE <= MAX_FRAME_SIZE) {
+            if (batch.size() + FRAME_HEADER_SIZE + body.size() > MAX_FRAME_SIZE) queueBatch();
+            appendBatchRecord(batch, body);
+            if (++batchRecords == 1) {
+                batchId++;
+                if (openedBatch != nullptr) *openedBatch = batchId;
+            }
+            if (batchRecords < batchSize) return 0;
+            queueBatch();
+        } else {
+            // stays behind the batched messages sent before it
+            if (lane == Lane::DATA) queueBatch();
+            lanes[(size_t) lane].emplace_back(std::move(body), lane);
+            numQueued++;
+        }
+        return writeQueued(fd, MSG_DONTWAIT);
+    }
+
+    // queues the batch id if it is still open, returns 0 or -1
+    status_t closeBatch(socketfd_t fd, uint64_t id) {
+        std::unique_lock<std::mutex> lock(queueLock);
+        if (id != batchId || batchRecords == 0) return 0;
+        queueBatch();
+        return writeQueued(fd, MSG_DONTWAIT);
+    }
+
+    // writes queued frames until the socket is full, returns 0 or -1
+    status_t flush(socketfd_t fd) {
+        std::unique_lock<std::mutex> lock(queueLock);
+        return writeQueued(fd, MSG_DONTWAIT);
+    }
+
+    // writes every queued frame and the open batch, blocking if it has to,
+    // before a connection is let go
+    status_t drain(socketfd_t fd) {
+        std::unique_lock<std::mutex> lock(queueLock);
+        if (batchRecords > 0) queueBatch();
+        return writeQueued(fd, 0);
+    }
+
+    // frames waiting for the socket, an open batch waits for its owner instead
+    bool hasPending() const {
+        return numQueued.load() > 0;
+    }
+
+    // drops everything queued, for a connection that closed
+    void reset() {
+        std::unique_lock<std::mutex> lock(queueLock);
+        for(std::deque<OutgoingFrame>& lane: lanes) lane.clear();
+        current = nullptr;
+        numQueued.store(0);
+        batch.clear();
+        batchRecords = 0;
+    }
+
+private:
+    // with queueLock held
+    void queueBatch() {
+        if (batchRecords == 0) return;
+        lanes[(size_t) Lane::DATA].emplace_back(std::move(batch), Lane::DATA, true);
+        numQueued++;
+        batch.clear();
+        batchRecords = 0;
+    }
+
+    // with queueLock held
+    status_t writeQueued(socketfd_t fd, int flags) {
+        while (true) {
+            if (current == nullptr) {
+                for(std::deque<OutgoingFrame>& lane: lanes) {
+                    if (!lane.empty()) {
+                        current = &lane;
+                        break;
+                    }
+                }
+                if (current == nullptr) return 0;
+            }
+
+            int status = fd < 0 ? -1 : current->front().writeTo(fd, flags);
+            if (status == 0) {
+                // nothing of it went out yet, a control frame may still go first
+                if (current->front().written == 0) current = nullptr;
+                return 0;
+            }
+            current->pop_front();
+            current = nullptr;
+            numQueued--;
+            if (status < 0) return -1;
+        }
+    }
+
+    std::mutex queueLock;
+    std::deque<OutgoingFrame> lanes[NUM_LANES];
+    // the lane whose front frame is partly written, it has to finish first
+    std::deque<OutgoingFrame>* current = nullptr;
+    std::atomic<size_t> numQueued{0};
+
+    size_t batchSize = 0;
+    std::string batch;
+    size_t batchRecords = 0;
+    uint64_t batchId = 0;
+};
+
+// Reassembles frames from one stream socket. Small frames are cut out of a
+// shared read chunk, large bodies are read straight into their own buffer.
+class FrameReader {
+public:
+
+    void reset() {
+        headerFilled = 0;
+        bodyFilled = 0;
+        inBody = false;
+        body.clear();
+    }
+
+    // reads once from fd and calls onFrame(std::string, Lane) for every
+    // completed frame, returns what read returned
+    template<typename OnFrame>
+    ssize_t readFrom(socketfd_t fd, char* chunk, size_t chunkSize, OnFrame onFrame) {
+        if (inBody && body.size() - bodyFilled >= chunkSize) {
+            ssize_t amount = read(fd, &body[bodyFilled], body.size() - bodyFilled);
+            if (amount <= 0) return amount;
+            bodyFilled += amount;
+            if (bodyFilled == body.size()) deliver(onFrame);
+            return amount;
+        }
+
+        ssize_t amount = read(fd, chunk, chunkSize);
+        if (amount <= 0) return amount;
+        consume(chunk, amount, onFrame);
+        return amount;
+    }
+
+private:
+    template<typename OnFrame>
+    void consume(const char* data, size_t len, OnFrame& onFrame) {
+        while (len > 0) {
+            if (!inBody) {
+                size_t amount = std::min(len, FRAME_HEADER_SIZE - headerFilled);
+                memcpy(header + headerFilled, data, amount);
+                headerFilled += amount;
+                data += amount;
+                len -= amount;
+                if (headerFilled < FRAME_HEADER_SIZE) return;
+
+                uint32_t length;
+                memcpy(&length, header, FRAME_HEADER_SIZE);
+                length = ntohl(length);
+                lane = (length & DATA_LANE_BIT) ? Lane::DATA : Lane::CONTROL;
+                batched = (length & BATCH_BIT) != 0;
+                length &= ~(DATA_LANE_BIT | BATCH_BIT);
+                if (length > MAX_FRAME_SIZE)
+                    throw std::runtime_error("Received frame larger than MAX_FRAME_SIZE");
+
+                headerFilled = 0;
+                inBody = true;
+                body.resize(length);
+                bodyFilled = 0;
+                if (length == 0) {
+                    deliver(onFrame);
+                    continue;
+                }
+            }
+
+            size_t amount = std::min(len, body.size() - bodyFilled);
+            memcpy(&body[bodyFilled], data, amount);
+            bodyFilled += amount;
+            data += amount;
+            len -= amount;
+            if (bodyFilled == body.size()) deliver(onFrame);
+        }
+    }
+
+    template<typename OnFrame>
+    void deliver(OnFrame& onFrame) {
+        std::string frame;
+        frame.swap(body);
+        inBody = false;
+        bodyFilled = 0;
+        if (!batched) {
+            onFrame(std::move(frame), lane);
+            return;
+        }
+
+        size_t offset = 0;
+        while (offset < frame.size()) {
+            uint32_t length;
+            if (frame.size() - offset < FRAME_HEADER_SIZE)
+                throw std::runtime_error("Received a batch cut short");
+            memcpy(&length, &frame[offset], FRAME_HEADER_SIZE);
+            length = ntohl(length);
+            offset += FRAME_HEADER_SIZE;
+            if (frame.size() - offset < length)
+                throw std::runtime_error("Received a batch cut short");
+            onFrame(frame.substr(offset, length), lane);
+            offset += length;
+        }
+    }
+
+    char header[FRAME_HEADER_SIZE];
+    size_t headerFilled = 0, bodyFilled = 0;
+    bool inBody = false, batched = false;
+    Lane lane = Lane::CONTROL;
+    std::string body;
+};
+
+// Frames read in one round of an event loop, handed on control lane first
+template<typename Source>
+class LaneDispatcher {
+public:
+
+    void add(Source source, std::string frame, Lane lane) {
+        lanes[(size_t) lane].emplace_back(source, std::move(frame));
+    }
+
+    // calls onFrame(Source, std::string) for every frame added, in lane order
+    template<typename OnFrame>
+    void dispatch(OnFrame onFrame) {
+        for(std::vector<std::pair<Source, std::string>>& lane: lanes) {
+            for(std::pair<Source, std::string>& frame: lane)
+                onFrame(frame.first, std::move(frame.second));
+            lane.clear();
+        }
+    }
+
+private:
+    std::vector<std::pair<Source, std::string>> lanes[NUM_LANES];
+};
+
+#endif
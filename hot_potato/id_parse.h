@@ -0,0 +1,153 @@
+#ifndef ID_PARSE
+#define ID_PARSE
+
+#include "common_defs.h"
+#include <stdexcept>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ID_PARSE_X86
+#endif
+
+/*
+Parsing of a delimited decimal id list such as "3,1,4,1", the history of a
+potato in IDS trace mode.
+
+The scalar parser walks the string once, byte by byte. The vector parsers
+find delimiters a block at a time (16 bytes with SSE4.2, 32 with AVX2) by a
+compare and movemask. They then convert each id of up to 16 digits at once
+with multiply-adds. The widest parser the CPU supports is picked on first
+use.
+
+All of them append to the output vector, and throw like stoull on an empty
+or non-numeric id. A trailing delimiter is ignored, as std::getline would.
+*/
+
+constexpr static size_t MAX_ID_DIGITS = 20;
+
+using IdParser = void (*)(const char* data, size_t len, char delimiter, std::vector<size_t>& ids);
+
+// value of n ascii digits
+size_t parseIdDigits(const char* digits, size_t n) {
+    if (n == 0)
+        throw std::invalid_argument("Empty id in id list");
+    if (n > MAX_ID_DIGITS)
+        throw std::out_of_range("Id " + std::string(digits, n) + " is out of range");
+    size_t value = 0;
+    for(size_t i = 0; i < n; i++) {
+        size_t digit = (unsigned char) digits[i] - '0';
+        if (digit > 9)
+            throw std::invalid_argument("Malformed id " + std::string(digits, n));
+        if (__builtin_mul_overflow(value, (size_t) 10, &value) || __builtin_add_overflow(value, digit, &value))
+            throw std::out_of_range("Id " + std::string(digits, n) + " is out of range");
+    }
+    return value;
+}
+
+void parseIdsScalar(const char* data, size_t len, char delimiter, std::vector<size_t>& ids) {
+    size_t tokenStart = 0;
+    for(size_t i = 0; i < len; i++) {
+        if (data[i] == delimiter) {
+            ids.push_back(parseIdDigits(data + tokenStart, i - tokenStart));
+            tokenStart = i + 1;
+        }
+    }
+    if (tokenStart < len)
+        ids.push_back(parseIdDigits(data + tokenStart, len - tokenStart));
+}
+
+#ifdef ID_PARSE_X86
+
+// value of the n <= 16 digits right aligned in chars, the bytes before them are ignored
+__attribute__((target("sse4.2")))
+inline size_t convertDigits16(__m128i chars, size_t n) {
+    __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    digits = _mm_and_si128(digits, _mm_cmpgt_epi8(index, _mm_set1_epi8((char) (15 - n))));
+
+    __m128i nine = _mm_set1_epi8(9);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(digits, nine), nine)) != 0xffff)
+        throw std::invalid_argument("Malformed id in id list");
+
+    // 16 digits -> 8 two digit -> 4 four digit -> 2 eight digit values
+    __m128i pairs = _mm_maddubs_epi16(digits, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 100, 1, 100, 1));
+    __m128i packed = _mm_packus_epi32(quads, quads);
+    __m128i octs = _mm_madd_epi16(packed, _mm_setr_epi16(10000, 1, 10000, 1, 10000, 1, 10000, 1));
+
+    uint64_t high = (uint32_t) _mm_cvtsi128_si32(octs);
+    uint64_t low = (uint32_t) _mm_extract_epi32(octs, 1);
+    return high * 100000000ull + low;
+}
+
+// the id in data[start, end)
+__attribute__((target("sse4.2")))
+inline size_t parseIdToken(const char* data, size_t start, size_t end) {
+    size_t n = end - start;
+    if (n == 0 || n > 16) return parseIdDigits(data + start, n);
+    if (end >= 16)
+        return convertDigits16(_mm_loadu_si128((const __m128i*) (data + end - 16)), n);
+    // too close to the start of the string for a 16 byte load
+    char padded[16];
+    memcpy(padded + 16 - n, data + start, n);
+    return convertDigits16(_mm_loadu_si128((const __m128i*) padded), n);
+}
+
+// scalar delimiter search from block on, then the last id
+__attribute__((target("sse4.2")))
+inline void finishIds(const char* data, size_t len, char delimiter, size_t tokenStart, size_t block, std::vector<size_t>& ids) {
+    for(size_t i = block; i < len; i++) {
+        if (data[i] == delimiter) {
+            ids.push_back(parseIdToken(data, tokenStart, i));
+            tokenStart = i + 1;
+        }
+    }
+    if (tokenStart < len)
+        ids.push_back(parseIdToken(data, tokenStart, len));
+}
+
+__attribute__((target("sse4.2")))
+void parseIdsSse42(const char* data, size_t len, char delimiter, std::vector<size_t>& ids) {
+    __m128i delimiters = _mm_set1_epi8(delimiter);
+    size_t tokenStart = 0, block = 0;
+    for(; block + 16 <= len; block += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (data + block));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, delimiters));
+        while (mask != 0) {
+            size_t position = block + __builtin_ctz(mask);
+            ids.push_back(parseIdToken(data, tokenStart, position));
+            tokenStart = position + 1;
+            mask &= mask - 1;
+        }
+    }
+    finishIds(data, len, delimiter, tokenStart, block, ids);
+}
+
+__attribute__((target("avx2")))
+void parseIdsAvx2(const char* data, size_t len, char delimiter, std::vector<size_t>& ids) {
+    __m256i delimiters = _mm256_set1_epi8(delimiter);
+    size_t tokenStart = 0, block = 0;
+    for(; block + 32 <= len; block += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (data + block));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, delimiters));
+        while (mask != 0) {
+            size_t position = block + __builtin_ctz(mask);
+            ids.push_back(parseIdToken(data, tokenStart, position));
+            tokenStart = position + 1;
+            mask &= mask - 1;
+        }
+    }
+    finishIds(data, len, delimiter, tokenStart, block, ids);
+}
+
+#endif
+
+IdParser selectIdParser() {
+    #ifdef ID_PARSE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return parseIdsAvx2;
+    if (__builtin_cpu_supports("sse4.2")) return parseIdsSse42;
+    #endif
+    return parseIdsScalar;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include "id_parse.h"
+#include <chrono>
+#include <random>
+#include <typeinfo>
+
+// the parsers this CPU can run, the scalar one first
+std::vector<std::pair<std::string, IdParser>> supportedParsers() {
+    std::vector<std::pair<std::string, IdParser>> parsers;
+    parsers.emplace_back("scalar", parseIdsScalar);
+    #ifdef ID_PARSE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) parsers.emplace_back("sse4.2", parseIdsSse42);
+    if (__builtin_cpu_supports("avx2")) parsers.emplace_back("avx2", parseIdsAvx2);
+    #endif
+    return parsers;
+}
+
+// the ids parsed, then the type of what was thrown if anything
+std::pair<std::vector<size_t>, std::string> runParser(IdParser parser, const std::string& list) {
+    std::vector<size_t> ids;
+    try {
+        parser(list.data(), list.size(), ',', ids);
+    } catch (const std::exception& e) {
+        return std::make_pair(ids, std::string(typeid(e).name()));
+    }
+    return std::make_pair(ids, std::string());
+}
+
+// an id list of random length and digit counts, sometimes malformed: empty
+// ids, stray bytes, more than MAX_ID_DIGITS digits or a value past size_t
+std::string randomIdList(std::mt19937_64& random) {
+    std::string list;
+    size_t numIds = random() % 40;
+    bool malformed = random() % 4 == 0;
+    for(size_t i = 0; i < numIds; i++) {
+        size_t numDigits = 1 + random() % (malformed ? MAX_ID_DIGITS + 2 : 16);
+        for(size_t d = 0; d < numDigits; d++) list += (char) ('0' + random() % 10);
+        if (malformed && random() % 50 == 0) list[list.size() - 1 - random() % numDigits] = "a/:, "[random() % 5];
+        if (i + 1 < numIds || random() % 8 == 0) list += ',';
+        if (malformed && random() % 50 == 0) list += ',';
+    }
+    return list;
+}
+
+// every parser against the scalar one on the same lists
+int check(size_t numCases, uint64_t seed) {
+    std::vector<std::pair<std::string, IdParser>> parsers = supportedParsers();
+    std::mt19937_64 random(seed);
+    std::vector<std::string> lists = {"", ",", "0", "7,", ",7", "1,,2", "18446744073709551615", "18446744073709551616",
+        "123456789012345678901", "0000000000000000012", "1234567890123456,12345678901234567"};
+    while (lists.size() < numCases) lists.push_back(randomIdList(random));
+
+    size_t failures = 0;
+    for(const std::string& list: lists) {
+        std::pair<std::vector<size_t>, std::string> expected = runParser(parsers[0].second, list);
+        for(size_t p = 1; p < parsers.size(); p++) {
+            if (runParser(parsers[p].second, list) == expected) continue;
+            if (failures++ < 10) std::cout << parsers[p].first << " differs from scalar on \"" << list << "\"\n";
+        }
+    }
+    std::cout << "Checked " << lists.size() << " lists against scalar with";
+    for(size_t p = 1; p < parsers.size(); p++) std::cout << " " << parsers[p].first;
+    std::cout << ", " << failures << " mismatches\n";
+    return failures == 0 ? 0 : 1;
+}
+
+// ids per second of every parser on a trace of numIds ids below numPlayers
+int bench(size_t numIds, size_t numPlayers, size_t rounds) {
+    std::mt19937_64 random(1);
+    std::string list;
+    for(size_t i = 0; i < numIds; i++) {
+        if (i > 0) list += ',';
+        list += std::to_string(random() % numPlayers);
+    }
+
+    std::vector<size_t> ids;
+    ids.reserve(numIds);
+    for(const std::pair<std::string, IdParser>& parser: supportedParsers()) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(size_t r = 0; r < rounds; r++) {
+            ids.clear();
+            parser.second(list.data(), list.size(), ',', ids);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << parser.first << ": " << numIds * rounds / elapsed.count() / 1e6 << " M ids/s, "
+                  << list.size() * rounds / elapsed.count() / 1e9 << " GB/s\n";
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2 || argc % 2 != 0) {
+        std::cout << "Usage: ./id_parse_test check [--cases <lists>] [--seed <seed>] | bench [--ids <ids>] [--players <players>] [--rounds <rounds>]\n";
+        return 1;
+    }
+
+    std::string mode(argv[1]);
+    std::map<std::string, std::string> flags = parseFlags(argc, argv, 2);
+    if (mode == "check")
+        return check(flags.count("cases") ? std::stoull(flags["cases"]) : 100000,
+                     flags.count("seed") ? std::stoull(flags["seed"]) : 1);
+    if (mode == "bench")
+        return bench(flags.count("ids") ? std::stoull(flags["ids"]) : 1000000,
+                     flags.count("players") ? std::stoull(flags["players"]) : 1000,
+                     flags.count("rounds") ? std::stoull(flags["rounds"]) : 20);
+    throw std::runtime_error("Unknown mode " + mode);
+}
@@ -0,0 +1,78 @@
+#ifndef LANES
+#define LANES
+
+#include "common_defs.h"
+#include <condition_variable>
+
+/*
+Priority lanes:
+
+Every message travels in one of two lanes. Control messages (setup, acks,
+checkpoints, shutdown) go in the control lane, potatoes and whatever must
+stay in order with them in the data lane. Control is strictly ahead of data
+wherever messages wait:
+
+    sending     a connection queues frames per lane and writes control
+                ones first, only a frame already partly written goes before
+    receiving   the frames read in one round of an event loop are handed on
+                control first
+    handling    control handlers get the game lock ahead of potato handlers
+                waiting for it
+
+So a control message may overtake potatoes sent before it, never the other
+way round.
+*/
+
+enum class Lane {
+    CONTROL = 0,
+    DATA = 1,
+};
+
+constexpr static size_t NUM_LANES = 2;
+
+// A mutex that is handed to waiters of the control lane before any of the
+// data lane. lock() takes the control lane, so it works with std::unique_lock.
+class LaneMutex {
+public:
+
+    void lock() {
+        lock(Lane::CONTROL);
+    }
+
+    void lock(Lane lane) {
+        std::unique_lock<std::mutex> guard(stateLock);
+        size_t laneIndex = (size_t) lane;
+        if (held || waiting[(size_t) Lane::CONTROL] > 0) {
+            waiting[laneIndex]++;
+            freed.wait(guard, [this, lane]() {
+                return !held && (lane == Lane::CONTROL || waiting[(size_t) Lane::CONTROL] == 0);
+            });
+            waiting[laneIndex]--;
+        }
+        held = true;
+    }
+
+    void unlock() {
+        bool anyWaiting;
+        {
+            std::unique_lock<std::mutex> guard(stateLock);
+            held = false;
+            anyWaiting = waiting[0] + waiting[1] > 0;
+        }
+        if (anyWaiting) freed.notify_all();
+    }
+
+    // the lock held in lane, released by the returned lock
+    std::unique_lock<LaneMutex> acquire(Lane lane) {
+        lock(lane);
+        return std::unique_lock<LaneMutex>(*this, std::adopt_lock);
+    }
+
+private:
+    std::mutex stateLock;
+    std::condition_variable freed;
+    bool held = false;
+    size_t waiting[NUM_LANES] = {0, 0};
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+#include "common_defs.h"
+#include <sstream>
+
+/*
+HDR style latency histogram over nanoseconds. Values are bucketed by power
+of two, and every power of two is split into SUB_BUCKETS linear sub buckets,
+so any recorded value is off by less than 1 / SUB_BUCKETS of itself, from
+nanoseconds up to hours, in a fixed ~50 KB.
+*/
+
+class LatencyHistogram {
+public:
+
+    LatencyHistogram() : counts((MAX_MAGNITUDE + 1) * SUB_BUCKETS, 0) {}
+
+    void record(uint64_t valueNs) {
+        counts[bucketOf(valueNs)]++;
+        totalCount++;
+        total += valueNs;
+        if (totalCount == 1 || valueNs < minValue) minValue = valueNs;
+        if (valueNs > maxValue) maxValue = valueNs;
+    }
+
+    size_t count() const {
+        return totalCount;
+    }
+
+    // smallest recorded value v such that percentile % of values are <= v,
+    // reported as the upper edge of its bucket
+    uint64_t valueAtPercentile(double percentile) const {
+        if (totalCount == 0) return 0;
+        size_t target = (size_t) (percentile / 100.0 * totalCount + 0.5);
+        if (target < 1) target = 1;
+        if (target > totalCount) target = totalCount;
+
+        size_t seen = 0;
+        for(size_t bucket = 0; bucket < counts.size(); bucket++) {
+            seen += counts[bucket];
+            if (seen >= target) return std::min(upperEdge(bucket), maxValue);
+        }
+        return maxValue;
+    }
+
+    std::string report() const {
+        std::ostringstream oss;
+        oss << "count: " << totalCount;
+        if (totalCount > 0) {
+            oss << ", min: " << minValue / 1e3 << " us"
+                << ", mean: " << (double) total / totalCount / 1e3 << " us"
+                << ", max: " << maxValue / 1e3 << " us\n";
+            const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+            for(double p: percentiles)
+                oss << "p" << p << ": " << valueAtPercentile(p) / 1e3 << " us\n";
+        } else {
+            oss << '\n';
+        }
+        return oss.str();
+    }
+
+private:
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return value;
+        size_t magnitude = 63 - __builtin_clzll(value);
+        size_t shift = magnitude - SUB_BUCKET_BITS;
+        size_t bucketGroup = shift + 1;
+        if (bucketGroup > MAX_MAGNITUDE) return (MAX_MAGNITUDE + 1) * SUB_BUCKETS - 1;
+        return bucketGroup * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t upperEdge(size_t bucket) {
+        size_t bucketGroup = bucket / SUB_BUCKETS;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        if (bucketGroup == 0) return sub;
+        size_t shift = bucketGroup - 1;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    constexpr static size_t SUB_BUCKET_BITS = 7;
+    constexpr static uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    constexpr static size_t MAX_MAGNITUDE = 45;
+
+    std::vector<size_t> counts;
+    size_t totalCount = 0;
+    uint64_t total = 0, minValue = 0, maxValue = 0;
+};
+
+#endif
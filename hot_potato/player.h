@@ -1,54 +1,150 @@
 
-#include "server.h"
-#include "client.h"
+#include "transport.h"
 #include "commands.h"
 #include <mutex>
 #include <chrono>
 #include <cstdlib>
+#include <deque>
+#include <memory>
+
+struct PlayerOptions {
+    TransportProfile profile;
+    // interface whose address is reported to the other players, any if empty
+    std::string interface;
+    int addressFamily = AF_INET;
+    // print every hop, turned off for simulated runs
+    bool verbose = true;
+    // ask to leave an elastic game this long after it started, 0 stays to the end
+    double leaveAfterSeconds = 0;
+};
+
+// "4" or "6" to the family of the address a player reports, see getLocalIP
+int parseAddressFamily(const std::string& str) {
+    if (str == "4") return AF_INET;
+    if (str == "6") return AF_INET6;
+    throw std::runtime_error("Unknown IP family " + str);
+}
 
-class Player {
+// fills options from the command line flags of a player
+void applyPlayerFlags(PlayerOptions& options, std::map<std::string, std::string>& flags) {
+    applyProfileFlags(options.profile, flags);
+    if (flags.count("iface")) options.interface = flags["iface"];
+    if (flags.count("ip-family")) options.addressFamily = parseAddressFamily(flags["ip-family"]);
+    if (flags.count("leave-after")) options.leaveAfterSeconds = std::stod(flags["leave-after"]);
+}
+
+template<typename Transport>
+class BasicPlayer {
 
 public:
 
-    Player(std::string _hostname, std::string _port) {
+    // prev, and in tree mode the parent; in an elastic game also a replaced
+    // prev and a joining one that has yet to close or be moved on
+    using PeerServer = typename Transport::template Server<4>;
+    using PeerClient = typename Transport::Client;
+
+    BasicPlayer(std::string _hostname, std::string _port, PlayerOptions _options = PlayerOptions()) {
         // initialize the server
-        selfHostName = getLocalIP();
+        options = _options;
+        profile = options.profile;
+        selfHostName = getLocalIP(options.interface, options.addressFamily);
+        if (selfHostName == "Error")
+            throw std::runtime_error("Unable to find a local address to report");
         #ifdef DEBUG
         std::cout << "hostname obtained as " << selfHostName << '\n';
         #endif
         ringmasterPort = _port;
         ringmasterHostName = _hostname;
-        ringmasterClient = Client(std::bind(&Player::onMessage, this, std::placeholders::_1), ringmasterHostName, ringmasterPort);
+        ringmasterClient.reset(new PeerClient(std::bind(&BasicPlayer::onMessage, this, std::placeholders::_1), ringmasterHostName, ringmasterPort, profile));
+        ringmasterClient->setCloseCallback(std::bind(&BasicPlayer::onRingmasterLost, this));
         done.store(false);
     }
 
-    ~Player() {
-        
+    void start() {
+        join();
     }
 
-    void start() {
-        ringmasterClient.start();
+    // registration as one flow, see awaitable.h: connect to the ringmaster,
+    // register and handle its answer, the id and port to listen on
+    Task join() {
+        status_t status = co_await ringmasterClient->connect();
+        if (status != 0) {
+            std::cerr << "Unable to connect to the ringmaster\n";
+            done.store(true);
+            co_return;
+        }
 
         CommandPacket initialPacket = initialPlayerMessage();
 
-        ringmasterClient.message(initialPacket.serialize());
+        ringmasterClient->message(initialPacket.serialize());
+
+        std::string assignment = co_await ringmasterClient->receive();
+        if (assignment.empty()) {
+            std::cerr << "Ringmaster closed the connection before assigning an id\n";
+            done.store(true);
+            co_return;
+        }
+        onMessage(std::move(assignment));
     }
 
-    void onServerMessage(size_t playerId, std::string message) {
-        onMessage(message);
+    // the first to connect to us is our prev, or in tree mode our parent,
+    // and says which; started before the server so it cannot be missed
+    Task greetFirstPeer() {
+        size_t connectionId = co_await selfServer.accept();
+        std::string greeting = co_await selfServer.receive(connectionId);
+        if (!greeting.empty())
+            onServerMessage(connectionId, std::move(greeting));
+    }
+
+    void onServerMessage(size_t connectionId, std::string message) {
+        if (PotatoFrame::matches(message)) {
+            receivePotatoFrame(std::move(message));
+            return;
+        }
+        CommandPacket commandPacket = CommandPacket::deserialize(message);
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(laneOf(commandPacket.commandType));
+
+        if (commandPacket.commandType == CommandType::PLAYER_HELLO) {
+            onPlayerHello(connectionId, std::move(commandPacket));
+            return;
+        }
+        // the tree parent connected to us to relay the setup
+        if (commandPacket.commandType == CommandType::RINGMASTER_SET_TREE) {
+            parentConnection = connectionId;
+            parentIsRingmaster = false;
+        }
+        onCommand(std::move(commandPacket));
     }
 
     void onMessage(std::string message) {
-        std::unique_lock<std::mutex> lock(forcedSerialReceive);
-        onCommand(CommandPacket::deserialize(message));
+        if (PotatoFrame::matches(message)) {
+            receivePotatoFrame(std::move(message));
+            return;
+        }
+        CommandPacket commandPacket = CommandPacket::deserialize(message);
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(laneOf(commandPacket.commandType));
+        onCommand(std::move(commandPacket));
     };
 
+    // potatoesHere counts the potatoes waiting for the lock too, which is
+    // the load reported to the neighbours
+    void receivePotatoFrame(std::string frame) {
+        potatoesHere++;
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(Lane::DATA);
+        forwardPotato(std::move(frame));
+        potatoesHere--;
+    }
+
     void onCommand(CommandPacket commandPacket) {
         switch(commandPacket.commandType) {
             case CommandType::RINGMASTER_SET_NEXT:
                 onRingmasterSetNext(std::move(commandPacket));
                 break;
 
+            case CommandType::RINGMASTER_SET_TREE:
+                onRingmasterSetTree(std::move(commandPacket));
+                break;
+
             case CommandType::RINGMASTER_ASSIGN_ID_PORT:
                 onRingmasterAssignIdPort(std::move(commandPacket));
                 break;
@@ -61,12 +157,33 @@ public:
                 onReceivePotato(std::move(commandPacket));
                 break;
             
-            case CommandType::PLAYER_REGISTER: 
             case CommandType::PLAYER_READY:
+                onChildReady(std::move(commandPacket));
+                break;
+
+            case CommandType::RINGMASTER_RESUME:
+                onRingmasterResume(std::move(commandPacket));
+                break;
+
+            case CommandType::PLAYER_UNLINK:
+                onPlayerUnlink(std::move(commandPacket));
+                break;
+
+            case CommandType::PLAYER_REGISTER: 
             case CommandType::PLAYER_REPORT_ADDR:
+            case CommandType::PLAYER_HELLO:
+            case CommandType::POTATO_CHECKPOINT:
+            case CommandType::PLAYER_REJOIN:
+            case CommandType::PLAYER_LEAVE:
                 throw std::runtime_error("Error, received player command");
                 break;
 
+            case CommandType::SEGMENT_HEAD:
+            case CommandType::SEGMENT_READY:
+            case CommandType::SEGMENT_POTATO:
+                throw std::runtime_error("Error, received ringmaster to ringmaster command");
+                break;
+
             default:
                 throw std::runtime_error("Error, unhandled command.");
                 break;
@@ -80,91 +197,266 @@ public:
     void onRingmasterSetNext(CommandPacket commandPacket) {
         
         // set the next host name, and next port
-        nextPlayerPort = commandPacket.commandArgs[2];
-        nextPlayerHostName = commandPacket.commandArgs[1];
-        nextId = stoi(commandPacket.commandArgs[0]);
-        
-        #ifdef DEBUG
-        std::cout << "Attempting to connect to next player hostname: " << nextPlayerHostName << ":" << nextPlayerPort << '\n';
-        #endif
+        const std::vector<std::string>& args = commandPacket.commandArgs;
+        connectToNext(stoi(args[0]), args[1], args[2], args.size() > 3 ? stoull(args[3]) : 0);
+    }
 
-        // connect to next
-        nextPlayerClient = Client(std::bind(&Player::onMessage, this, std::placeholders::_1),
-                                  nextPlayerHostName,
-                                  nextPlayerPort);
+    void onRingmasterSetTree(CommandPacket commandPacket) {
+        const std::vector<std::string>& args = commandPacket.commandArgs;
+        size_t fanout = stoull(args[0]);
+        size_t start = stoull(args[1]);
+        size_t end = stoull(args[2]);
+        subtreeSize = end - start;
 
+        // relay to the children first, so the tree below sets up in parallel with us
+        for(const std::pair<size_t, size_t>& range: splitRange(start + 1, end, fanout)) {
+            const size_t first = 3 + 2 * (range.first - start);
 
-        #ifdef DEBUG
-        std::cout << "Client object created. Starting\n";
-        #endif 
+            childClients.emplace_back();
+            PeerClient& child = childClients.back();
+            child = PeerClient(std::bind(&BasicPlayer::onMessage, this, std::placeholders::_1), args[first], args[first + 1], profile);
 
+            CommandPacket packet;
+            packet.author = id;
+            packet.commandType = CommandType::RINGMASTER_SET_TREE;
+            packet.commandArgs.push_back(args[0]);
+            packet.commandArgs.push_back(std::to_string(range.first));
+            packet.commandArgs.push_back(std::to_string(range.second));
+            packet.commandArgs.insert(packet.commandArgs.end(), args.begin() + first, args.begin() + first + 2 * (range.second - range.first + 1));
+            relayTree(child, std::move(packet));
+        }
+
+        connectToNext((id + 1) % totNumPlayers, args[5], args[6]);
+    }
+
+    // child stays where it is, childClients is a deque
+    Task relayTree(PeerClient& child, CommandPacket packet) {
+        status_t status = co_await child.connect();
+
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(Lane::CONTROL);
+        if (status != 0) {
+            leaveUnconnected("tree child");
+            co_return;
+        }
+        child.message(packet.serialize());
+    }
 
-        if (nextPlayerClient.start() != 0)
-            throw std::runtime_error("Unable to connect to next client");
+    void onChildReady(CommandPacket commandPacket) {
+        numChildrenReady++;
+        reportReadyIfConnected();
+    }
 
+    // in an elastic game the old next keeps getting potatoes until the new
+    // one is connected, and stays open for whatever it sends back. The
+    // handler calling this returns once the connection is being made, the
+    // rest goes on on the new client's thread, see awaitable.h
+    Task connectToNext(size_t _nextId, std::string hostName, std::string port, size_t ringVersion = 0) {
+        size_t attempt = ++nextAttempts;
 
         #ifdef DEBUG
-        std::cout << "Waiting for connection from Player " << prevId << '\n';
+        std::cout << "Attempting to connect to next player hostname: " << hostName << ":" << port << '\n';
         #endif
-        // if connection successful, then wait for previous to connect
-        while(selfServer.getNumConnections() < 1) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        std::unique_ptr<PeerClient> client(new PeerClient(std::bind(&BasicPlayer::onMessage, this, std::placeholders::_1),
+                                                          hostName,
+                                                          port,
+                                                          profile));
+        status_t status = co_await client->connect();
+
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(Lane::CONTROL);
+        // moved on again or shut down while connecting, nothing went over
+        // the connection so it is closed at once
+        if (attempt != nextAttempts || done.load()) {
+            if (status == 0) client->shutdown();
+            retiredClients.push_back(std::move(client));
+            co_return;
+        }
+        if (status != 0) {
+            retiredClients.push_back(std::move(client));
+            leaveUnconnected("next player " + hostName + ":" + port);
+            co_return;
+        }
+
+        size_t oldNextId = nextId;
+        std::unique_ptr<PeerClient> oldNext = std::move(nextPlayerClient);
+        nextPlayerClient = std::move(client);
+        nextId = _nextId;
+        nextVersion = ringVersion;
+        neighbourLoads[0] = NeighbourLoad();
+        nextPlayerHostName = hostName;
+        nextPlayerPort = port;
+
+        // tell next which of its connections is its prev
+        CommandPacket hello;
+        hello.author = id;
+        hello.commandType = CommandType::PLAYER_HELLO;
+        if (ringVersion > 0)
+            hello.commandArgs.push_back(std::to_string(ringVersion));
+        nextPlayerClient->message(hello.serialize());
+
+        // moved on mid game, tell the old next and the ringmaster; the old
+        // next is closed once it stopped sending back too, see Player_Unlink
+        if (oldNext) {
+            if (options.verbose) std::cout << "Next moved from " << oldNextId << " to " << nextId << '\n';
+            CommandPacket unlink{(int) id, CommandType::PLAYER_UNLINK, {}};
+            oldNext->message(unlink.serialize(), Lane::DATA);
+            if (nextUnlinked)
+                oldNext->shutdown();
+            else
+                unlinkingNexts[oldNextId] = oldNext.get();
+            nextUnlinked = false;
+            retiredClients.push_back(std::move(oldNext));
+            CommandPacket ready{(int) id, CommandType::PLAYER_READY, {}};
+            ringmasterClient->message(ready.serialize());
+            co_return;
         }
 
+        nextConnected = true;
+        reportReadyIfConnected();
+    }
+
+    void onPlayerHello(size_t connectionId, CommandPacket commandPacket) {
         #ifdef DEBUG
-        std::cout << "Player " << prevId << " has successfully connected\n";
+        std::cout << "Player " << commandPacket.author << " has successfully connected\n";
         #endif
 
-        // upon previous connecting, report ready
+        size_t ringVersion = commandPacket.commandArgs.empty() ? 0 : stoull(commandPacket.commandArgs[0]);
+        // a later change already gave us another prev, the sender will be moved on too
+        if (prevConnected && ringVersion < prevVersion)
+            return;
+        if (prevConnected && connectionId != prevConnection) {
+            CommandPacket unlink{(int) id, CommandType::PLAYER_UNLINK, {}};
+            selfServer.message(prevConnection, unlink.serialize(), Lane::DATA);
+            prevUnlinked = false;
+        }
+
+        prevConnection = connectionId;
+        prevId = commandPacket.author;
+        neighbourLoads[1] = NeighbourLoad();
+        prevVersion = ringVersion;
+        prevConnected = true;
+        reportReadyIfConnected();
+    }
+
+    // ready once connected to next and prev has connected to us, in either
+    // order, and in tree mode once every child's subtree is ready too. A
+    // player joining mid game is ready as soon as it reaches next, its prev
+    // is only moved on to it after that
+    void reportReadyIfConnected() {
+        if (!nextConnected || (!prevConnected && nextVersion == 0) || readyReported) return;
+        if (numChildrenReady < childClients.size()) return;
+        readyReported = true;
+        scheduleLeave();
+
         CommandPacket packet;
 
         packet.author = id;
         packet.commandType = CommandType::PLAYER_READY;
 
-        ringmasterClient.message(packet.serialize());
+        if (subtreeSize == 0) {
+            ringmasterClient->message(packet.serialize());
+            return;
+        }
+        packet.commandArgs.push_back(std::to_string(subtreeSize));
+        if (parentIsRingmaster)
+            ringmasterClient->message(packet.serialize());
+        else
+            selfServer.message(parentConnection, packet.serialize());
     }
 
     void onReceivePotato(CommandPacket commandPacket) {
 
         Potato potato = Potato::parsePotato(commandPacket.commandArgs);
+        if (potato.potatoId / POTATO_EPOCH_STRIDE < epoch)
+            return;
+        if (isCheckpointHop(potato.numHops)) {
+            CommandPacket checkpoint{(int) id, CommandType::POTATO_CHECKPOINT, commandPacket.commandArgs};
+            ringmasterClient->message(checkpoint.serialize());
+        }
 
         // if hops is zero, that's an error
         // otherwise, decrement hops and add self
         // if hops = 0, send to ringmaster
         // else randomly choose next or previous and send it to them
         
-        
+        noteNeighbourLoad(commandPacket.author, potato.senderLoad, potato.received);
 
         if (potato.numHops == 0) {
             throw std::runtime_error("Player should not be receiving cold potato\n");
         } else {
             potato.numHops--;
-            potato.ids.push_back(id);
 
             CommandPacket packet;
             packet.author = id;
             packet.commandType = CommandType::GIVE_POTATO;
-            packet.commandArgs = potato.serialize_to_vec();
+            packet.payload = std::move(commandPacket.payload);
 
             if (potato.numHops == 0) {
-                std::cout << "I'm it\n";
-                ringmasterClient.message(packet.serialize());
+                if (options.verbose) std::cout << "I'm it\n";
+                potato.recordLastHop(id);
+                packet.commandArgs = potato.serialize_to_vec();
+                ringmasterClient->message(packet.serialize(), Lane::DATA);
             } else {
-                bool forward = (bool) (rand() % 2);
+                bool forward = passForward();
+
+                potato.recordHop(id, forward ? 0 : 1);
+                potato.senderLoad = potatoesHere.load();
+                potato.received = neighbourLoads[forward ? 0 : 1].received;
+                packet.commandArgs = potato.serialize_to_vec();
 
                 if (forward) {
-                    std::cout << "Sending potato to " << nextId << '\n';
-                    nextPlayerClient.message(packet.serialize());
+                    if (options.verbose) std::cout << "Sending potato to " << nextId << '\n';
+                    nextPlayerClient->message(packet.serialize(), Lane::DATA);
 
                 } else {
-                    std::cout << "Sending potato to " << prevId << '\n';
-                    selfServer.message(0, packet.serialize());
+                    if (options.verbose) std::cout << "Sending potato to " << prevId << '\n';
+                    selfServer.message(prevConnection, packet.serialize(), Lane::DATA);
                 }
             }
             
         }
     }
 
+    // cut-through version of onReceivePotato, patches the received frame and sends it on
+    void forwardPotato(std::string frame) {
+        PotatoFrame potato(frame);
+        size_t numHops = potato.numHops();
+
+        if (numHops == 0)
+            throw std::runtime_error("Player should not be receiving cold potato\n");
+        // left over from before a ringmaster restart, the potato was resent from its checkpoint
+        if (potato.potatoId() / POTATO_EPOCH_STRIDE < epoch)
+            return;
+        if (isCheckpointHop(numHops))
+            ringmasterClient->message(potato.checkpoint(id));
+
+        noteNeighbourLoad(potato.author(), potato.senderLoad(), potato.received());
+        numHops--;
+        potato.setNumHops(numHops);
+        potato.setAuthor(id);
+
+        if (numHops == 0) {
+            if (options.verbose) std::cout << "I'm it\n";
+            potato.recordLastHop(id);
+            ringmasterClient->message(std::move(frame), Lane::DATA);
+        } else {
+            bool forward = passForward();
+
+            potato.recordHop(id, forward ? 0 : 1);
+            // the others queued behind this one
+            potato.setSenderLoad(potatoesHere.load() - 1);
+            potato.setReceived(neighbourLoads[forward ? 0 : 1].received);
+
+            if (forward) {
+                if (options.verbose) std::cout << "Sending potato to " << nextId << '\n';
+                nextPlayerClient->message(std::move(frame), Lane::DATA);
+            } else {
+                if (options.verbose) std::cout << "Sending potato to " << prevId << '\n';
+                selfServer.message(prevConnection, std::move(frame), Lane::DATA);
+            }
+        }
+    }
+
     void onRingmasterAssignIdPort(CommandPacket commandPacket) {
 
         // assign self id
@@ -172,11 +464,18 @@ public:
         selfPort = commandPacket.commandArgs[1];
         prevId = stoi(commandPacket.commandArgs[2]);
         totNumPlayers = stoi(commandPacket.commandArgs[3]);
-
-        std::cout << "Connected as player " << id << " out of " << totNumPlayers << " total players\n";
+        if (commandPacket.commandArgs.size() > 4)
+            checkpointHops = stoull(commandPacket.commandArgs[4]);
+        if (commandPacket.commandArgs.size() > 5)
+            routing = parseRoutingPolicy(commandPacket.commandArgs[5]);
+
+        if (options.verbose) std::cout << "Connected as player " << id << " out of " << totNumPlayers << " total players\n";
+        if (ThreadPlacement::instance().isNuma())
+            ThreadPlacement::instance().placeOnNode(id, totNumPlayers);
         
         // start a server at the port
-        selfServer = Server<1>(std::bind(&Player::onServerMessage, this, std::placeholders::_1, std::placeholders::_2), selfPort);
+        selfServer = PeerServer(std::bind(&BasicPlayer::onServerMessage, this, std::placeholders::_1, std::placeholders::_2), selfPort, profile);
+        greetFirstPeer();
 
         if (selfServer.start() != 0) {
             throw std::runtime_error("Did not succesfully start self server");
@@ -206,7 +505,7 @@ public:
         std::cout << "Attempting to send message..." << '\n';
         #endif
 
-        ringmasterClient.message(packet.serialize());
+        ringmasterClient->message(packet.serialize());
 
         #ifdef DEBUG
         std::cout << "Self hostname and port sent to ringmaster\n";
@@ -219,27 +518,186 @@ public:
         std::cout << "Ringmaster requested shutdown\n";
         #endif
 
-        // set done and return
-        ringmasterClient.shutdown();
+        // pass it down the tree, then set done and return
+        for(PeerClient& child: childClients)
+            child.message(commandPacket.serialize());
+        for(PeerClient& child: childClients)
+            child.shutdown();
+        ringmasterClient->shutdown();
         selfServer.shutdown();
-        nextPlayerClient.shutdown();
+        if (nextPlayerClient) nextPlayerClient->shutdown();
 
         done.store(true);
     }
 
+    // a neighbour that unlinked sends nothing more, anything it sent before
+    // arrived ahead of the unlink. An old next is closed then, and a leaving
+    // player is out of the ring once both neighbours unlinked
+    void onPlayerUnlink(CommandPacket commandPacket) {
+        size_t author = commandPacket.author;
+        typename std::map<size_t, PeerClient*>::iterator oldNext = unlinkingNexts.find(author);
+        if (oldNext != unlinkingNexts.end()) {
+            oldNext->second->shutdown();
+            unlinkingNexts.erase(oldNext);
+        }
+        if (author == prevId) prevUnlinked = true;
+        if (author == nextId) nextUnlinked = true;
+        if (!leaving || !prevUnlinked || !nextUnlinked) return;
+
+        std::cout << "Left the ring\n";
+        onRingmasterShutdown(CommandPacket{(int) id, CommandType::RINGMASTER_SHUTDOWN, {}});
+    }
+
+    // the ring cannot form or go on without the connection, so the player
+    // goes down as on a shutdown rather than waiting forever; under the lock
+    void leaveUnconnected(const std::string& peer) {
+        std::cerr << "Unable to connect to " << peer << ", leaving the game\n";
+        if (!done.load())
+            onRingmasterShutdown(CommandPacket{(int) id, CommandType::RINGMASTER_SHUTDOWN, {}});
+    }
+
+    void onRingmasterResume(CommandPacket commandPacket) {
+        epoch = stoull(commandPacket.commandArgs[0]);
+        if (options.verbose) std::cout << "Ringmaster resumed the game in epoch " << epoch << '\n';
+    }
+
+    // on the ringmaster client's thread as the connection closes; a game with
+    // checkpoints waits for a restarted ringmaster instead of going down
+    void onRingmasterLost() {
+        ringmasterClosed.store(true);
+        if (done.load() || checkpointHops == 0) return;
+        if (reconnecting.exchange(true)) return;
+        scheduleReconnect(true);
+    }
+
     bool isDone() {
         return done.load();
     }
 
 private:
-    size_t id, nextId, prevId, totNumPlayers;
+
+    // next (true) or prev, see routing.h
+    bool passForward() {
+        // until a joining player's prev connects, everything goes on forward
+        bool forward = chooseNeighbour(routing, neighbourLoads, 2) == 0 || !prevConnected;
+        neighbourLoads[forward ? 0 : 1].onSend();
+        return forward;
+    }
+
+    // in a ring of two next and prev are the same player
+    void noteNeighbourLoad(int author, size_t load, size_t received) {
+        if (author < 0) return;
+        if ((size_t) author == nextId) neighbourLoads[0].report(load, received);
+        if ((size_t) author == prevId) neighbourLoads[1].report(load, received);
+    }
+
+    void scheduleLeave() {
+        if (options.leaveAfterSeconds <= 0) return;
+        std::chrono::duration<double> delay(options.leaveAfterSeconds);
+        ringmasterClient->scheduleAt(Transport::Clock::now() + std::chrono::duration_cast<typename Transport::Clock::duration>(delay), [this]() {
+            std::unique_lock<LaneMutex> lock(forcedSerialReceive);
+            if (done.load()) return;
+            leaving = true;
+            CommandPacket leave{(int) id, CommandType::PLAYER_LEAVE, {}};
+            ringmasterClient->message(leave.serialize());
+        });
+    }
+
+    // the next try to reach the ringmaster, a second from now on our server's
+    // loop; in tree mode the shutdown comes down the tree and may arrive
+    // after the ringmaster left, so the first try waits too
+    void scheduleReconnect(bool justLost) {
+        std::chrono::seconds delay(1);
+        selfServer.scheduleAt(Transport::Clock::now() + std::chrono::duration_cast<typename Transport::Clock::duration>(delay), [this, justLost]() {
+            if (done.load()) {
+                reconnecting.store(false);
+                return;
+            }
+            if (justLost) std::cout << "Lost the ringmaster, waiting for it to come back\n";
+            reconnect();
+        });
+    }
+
+    // the client swapped in takes over the close callback, so a ringmaster
+    // that goes down again is waited for again. It may go down before the
+    // flag is cleared, when onRingmasterLost leaves it to us, so the new
+    // client is checked once more after clearing
+    Task reconnect() {
+        std::unique_ptr<PeerClient> client(new PeerClient(std::bind(&BasicPlayer::onMessage, this, std::placeholders::_1), ringmasterHostName, ringmasterPort, profile));
+        client->setCloseCallback(std::bind(&BasicPlayer::onRingmasterLost, this));
+        ringmasterClosed.store(false);
+        status_t status = co_await client->connect();
+
+        std::unique_lock<LaneMutex> lock(forcedSerialReceive);
+        if (status != 0 || done.load()) {
+            if (status == 0) client->shutdown();
+            retiredClients.push_back(std::move(client));
+            if (done.load())
+                reconnecting.store(false);
+            else
+                scheduleReconnect(false);
+            co_return;
+        }
+        // the old client's thread may still be on its way out of onRingmasterLost
+        retiredClients.push_back(std::move(ringmasterClient));
+        ringmasterClient = std::move(client);
+        CommandPacket rejoin{(int) id, CommandType::PLAYER_REJOIN, {std::to_string(id)}};
+        ringmasterClient->message(rejoin.serialize());
+
+        reconnecting.store(false);
+        if (ringmasterClosed.load() && !done.load() && !reconnecting.exchange(true))
+            scheduleReconnect(true);
+    }
+
+    // no checkpoints while the ringmaster is away, the restarted one resends the last it got
+    bool isCheckpointHop(size_t numHops) const {
+        return checkpointHops > 0 && numHops % checkpointHops == 0 && !reconnecting.load();
+    }
+
+    size_t id = 0, nextId = 0, prevId = 0, totNumPlayers = 0;
     std::string ringmasterHostName, nextPlayerHostName, selfHostName;
     std::string ringmasterPort, nextPlayerPort, selfPort;
-
-    Server<1> selfServer;
-    Client ringmasterClient, nextPlayerClient;
+    PlayerOptions options;
+    TransportProfile profile;
+
+    PeerServer selfServer;
+    // replaced when a restarted ringmaster is reconnected to, and next when
+    // moved on in an elastic game
+    std::unique_ptr<PeerClient> ringmasterClient, nextPlayerClient;
+    // replaced clients live on, their threads may still be running and an
+    // old next may still send potatoes back
+    std::vector<std::unique_ptr<PeerClient>> retiredClients;
+    // retired nexts still sending back, by id, until their Player_Unlink
+    std::map<size_t, PeerClient*> unlinkingNexts;
+    bool nextConnected = false, prevConnected = false;
+    size_t prevConnection = 0;
+    // connections to a next started so far, only the latest is kept
+    size_t nextAttempts = 0;
+
+    // elastic games: ring versions of the current next and prev, see Player_Hello
+    size_t nextVersion = 0, prevVersion = 0;
+    bool leaving = false, prevUnlinked = false, nextUnlinked = false;
+
+    // load aware routing, indexed like recordHop: next, then prev
+    RoutingPolicy routing = RoutingPolicy::RANDOM;
+    NeighbourLoad neighbourLoads[2];
+    std::atomic<size_t> potatoesHere{0};
+
+    // tree mode, subtreeSize counts this player too and is 0 outside tree mode
+    std::deque<PeerClient> childClients;
+    size_t subtreeSize = 0, numChildrenReady = 0, parentConnection = 0;
+    bool parentIsRingmaster = true, readyReported = false;
     std::atomic<bool> done;
 
-    std::mutex forcedSerialReceive;
+    // checkpointing, 0 is off; potatoes of epochs before a resume are dropped
+    size_t checkpointHops = 0, epoch = 0;
+    std::atomic<bool> reconnecting{false};
+    // set by the close callback of the latest ringmaster client
+    std::atomic<bool> ringmasterClosed{false};
+
+    // control handlers get it ahead of potatoes, see lanes.h
+    LaneMutex forcedSerialReceive;
 };
 
+using Player = BasicPlayer<SocketTransport>;
+
@@ -3,15 +3,26 @@
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 3) {
-        std::cout << "Usage: ./player <host machine name> <ringmaster port>\n";
+    if (argc < 3 || argc % 2 != 1) {
+        std::cout << "Usage: ./player <host machine name> <ringmaster port> [--profile default|latency|throughput] [--batch-delay-us <us> --batch-size <potatoes>] [--spin-us <us>] [--connect-timeout-ms <ms>] [--idle-timeout-ms <ms>] [--cpus <list>|numa] [--iface <interface>] [--ip-family 4|6] [--leave-after <seconds>] [--record <wire log>]\n";
         return 0;
     }
 
     std::string hostname = std::string(argv[1]);
     std::string hostPort = std::string(argv[2]);
 
-    Player player(hostname, hostPort);
+    PlayerOptions options;
+    std::map<std::string, std::string> flags = parseFlags(argc, argv, 3);
+    applyPlayerFlags(options, flags);
+    if (flags.count("cpus")) ThreadPlacement::instance().configure(flags["cpus"]);
+
+    if (flags.count("record")) {
+        std::vector<std::string> args(argv + 1, argv + argc);
+        if (WireRecorder::instance().open(flags["record"], "player", args) != 0)
+            return 1;
+    }
+
+    Player player(hostname, hostPort, options);
 
     player.start();
 
@@ -21,4 +32,5 @@ int main(int argc, char* argv[]) {
     #ifdef DEBUG
     std::cout << "Player is done\n";
     #endif
+    WireRecorder::instance().close();
 }
\ No newline at end of file
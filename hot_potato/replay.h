@@ -0,0 +1,239 @@
+#ifndef REPLAY
+#define REPLAY
+
+#include "sim.h"
+#include <deque>
+
+/*
+Replay of a wire log (wire_log.h) into a real Player or RingMaster:
+
+    Replayer        hands each recorded received frame to the endpoint that
+                    received it, advancing the simulator's virtual clock to
+                    the recorded time first
+    ReplayServer,
+    ReplayClient    drop-in replacements for Server and Client that register
+                    with the Replayer on start and drop everything sent
+
+A wire log has frames but no connection events, so a replayed server
+accepts a connection as its first frame comes in, just ahead of it.
+
+Everything runs on the replaying thread, so a replay is deterministic.
+*/
+
+class Replayer {
+public:
+
+    static Replayer& instance() {
+        static Replayer replayer;
+        return replayer;
+    }
+
+    uint32_t attach(std::function<void(size_t, std::string)> callback) {
+        endpoints.push_back(std::move(callback));
+        return endpoints.size() - 1;
+    }
+
+    // delivers the frame at the recorded time, runs the handler before returning
+    void deliver(uint64_t timeNs, uint32_t endpoint, uint32_t connection, std::string frame) {
+        if (endpoint >= endpoints.size())
+            throw std::runtime_error("Wire log has a frame for endpoint " + std::to_string(endpoint) + ", which was never started");
+        Simulator& simulator = Simulator::instance();
+        simulator.scheduleAt(timeNs, Delivery{&endpoints[endpoint], connection, std::move(frame)});
+        simulator.run();
+    }
+
+    void discard(const std::string& message) {
+        numSent++;
+        bytesSent += message.size();
+    }
+
+    size_t getNumSent() const {
+        return numSent;
+    }
+
+    size_t getBytesSent() const {
+        return bytesSent;
+    }
+
+private:
+    Replayer() = default;
+
+    struct Delivery {
+        std::function<void(size_t, std::string)>* callback;
+        uint32_t connection;
+        std::string frame;
+
+        void operator()() {
+            (*callback)(connection, std::move(frame));
+        }
+    };
+
+    // a deque keeps the callbacks in place as endpoints are added mid replay
+    std::deque<std::function<void(size_t, std::string)>> endpoints;
+    size_t numSent = 0, bytesSent = 0;
+};
+
+template<size_t N>
+class ReplayServer {
+public:
+
+    ReplayServer() = default;
+    ReplayServer(std::function<void(size_t, std::string)> _callback, std::string _port, TransportProfile _profile = TransportProfile()) {
+        callback = _callback;
+        port = _port;
+        initialized = true;
+    }
+
+    ReplayServer& operator=(ReplayServer&& server) {
+        if (this->initialized)
+            throw std::runtime_error("Trying to initialize an initialized server");
+        if (!server.initialized)
+            throw std::runtime_error("Trying to initialize w/ uninitialized server");
+
+        server.initialized = false;
+        port = server.port;
+        callback = std::move(server.callback);
+        initialized = true;
+        return *this;
+    }
+
+    int start() {
+        if (!initialized)
+            throw std::runtime_error("Not initialized!");
+        Replayer::instance().attach([this](size_t connection, std::string frame) {
+            if (!accepted[connection]) {
+                accepted[connection] = true;
+                size_t acceptedId = connection;
+                acceptors.offer(acceptedId);
+            }
+            if (!receivers[connection].offer(frame)) callback(connection, std::move(frame));
+        });
+        started = true;
+        return 0;
+    }
+
+    // see Server
+    Awaitable<size_t> accept() {
+        return Awaitable<size_t>([this](std::function<void(size_t)> onAccepted) {
+            acceptors.add(std::move(onAccepted));
+        });
+    }
+
+    Awaitable<std::string> receive(size_t clientId) {
+        return Awaitable<std::string>([this, clientId](std::function<void(std::string)> onFrame) {
+            receivers[clientId].add(std::move(onFrame));
+        });
+    }
+
+    void shutdown() {}
+
+    void message(size_t clientId, std::string message, Lane lane = Lane::CONTROL) {
+        Replayer::instance().discard(message);
+    }
+
+    uint64_t scheduleAt(SimClock::time_point when, std::function<void()> callback) {
+        return Simulator::instance().scheduleAt(when.time_since_epoch().count(), std::move(callback));
+    }
+
+    void cancel(uint64_t id) {
+        Simulator::instance().cancel(id);
+    }
+
+    std::pair<std::string, std::string> getServerInfo() {
+        if (!started)
+            throw std::runtime_error("Server is not initialized or not started.");
+        return {"replay", port};
+    }
+
+    std::pair<std::string, std::string> getClientInfo(size_t clientId) {
+        return {"replay", std::to_string(clientId)};
+    }
+
+private:
+    std::string port;
+    std::function<void(size_t, std::string)> callback;
+    // connections that sent a frame yet, a log does not say when one closes
+    bool accepted[N] = {};
+    Waiters<size_t> acceptors;
+    Waiters<std::string> receivers[N];
+    bool initialized = false, started = false;
+};
+
+class ReplayClient {
+public:
+
+    ReplayClient() = default;
+    ReplayClient(std::function<void(std::string)> _callback, std::string _hostname, std::string _port, TransportProfile _profile = TransportProfile()) {
+        callback = _callback;
+        initialized = true;
+    }
+
+    ReplayClient& operator=(ReplayClient&& client) {
+        if (this->initialized)
+            throw std::runtime_error("Trying to initialized an initialized client");
+        if (!client.initialized)
+            throw std::runtime_error("Trying to initialize client with uninitialized client");
+
+        callback = std::move(client.callback);
+        initialized = true;
+        client.initialized = false;
+        return *this;
+    }
+
+    int start() {
+        if (!initialized)
+            throw std::runtime_error("Not initialized!");
+        Replayer::instance().attach([this](size_t connection, std::string frame) {
+            if (!receivers.offer(frame)) callback(std::move(frame));
+        });
+        return 0;
+    }
+
+    // registers in the order start() would have, the coroutine goes on as
+    // the simulator's next event
+    Awaitable<int> connect() {
+        return Awaitable<int>([this](std::function<void(int)> onConnected) {
+            int status = start();
+            Simulator::instance().scheduleAt(Simulator::instance().now(), [onConnected, status]() {
+                onConnected(status);
+            });
+        });
+    }
+
+    Awaitable<std::string> receive() {
+        return Awaitable<std::string>([this](std::function<void(std::string)> onFrame) {
+            receivers.add(std::move(onFrame));
+        });
+    }
+
+    void shutdown() {}
+
+    void setCloseCallback(std::function<void()>) {}
+
+    void message(std::string message, Lane lane = Lane::CONTROL) {
+        Replayer::instance().discard(message);
+    }
+
+    uint64_t scheduleAt(SimClock::time_point when, std::function<void()> callback) {
+        return Simulator::instance().scheduleAt(when.time_since_epoch().count(), std::move(callback));
+    }
+
+    void cancel(uint64_t id) {
+        Simulator::instance().cancel(id);
+    }
+
+private:
+    std::function<void(std::string)> callback;
+    Waiters<std::string> receivers;
+    bool initialized = false;
+};
+
+struct ReplayTransport {
+    template<size_t N>
+    using Server = ReplayServer<N>;
+    using Client = ReplayClient;
+    using Clock = SimClock;
+    static constexpr bool REAL_TIME = false;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "replay.h"
+#include "ringmaster.h"
+#include "player.h"
+#include <memory>
+
+// argv style view of the recorded command line, so the usual flag parsing applies
+std::map<std::string, std::string> recordedFlags(const std::vector<std::string>& args, int first) {
+    std::vector<char*> argv;
+    argv.push_back((char*) "replay");
+    for(const std::string& arg: args) argv.push_back((char*) arg.c_str());
+    return parseFlags(argv.size(), argv.data(), first + 1);
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2 || argc % 2 != 0) {
+        std::cout << "Usage: ./replay <wire log> [--speed max|recorded] [--trace-out <file>|-|none] [--stats-out <file>|-|none] [--verbose yes|no]\n";
+        return 1;
+    }
+
+    WireLogReader log;
+    if (log.open(argv[1]) != 0)
+        return 1;
+
+    std::map<std::string, std::string> flags = parseFlags(argc, argv, 2);
+    bool recordedSpeed = flags.count("speed") && flags["speed"] == "recorded";
+    const std::vector<std::string>& args = log.getArgs();
+
+    // one of the two is made, depending on who recorded the log
+    std::unique_ptr<BasicRingMaster<ReplayTransport>> rm;
+    std::unique_ptr<BasicPlayer<ReplayTransport>> player;
+
+    if (log.getRole() == "ringmaster") {
+        if (args.size() < 3)
+            throw std::runtime_error("Wire log has a malformed ringmaster command line");
+        RingMasterOptions options;
+        std::map<std::string, std::string> recorded = recordedFlags(args, 3);
+        applyRingMasterFlags(options, recorded);
+        if (options.injectRate > 0) {
+            std::cerr << "Open loop recordings cannot be replayed, the injector is not driven by frames\n";
+            return 1;
+        }
+        // never overwrite the recorded run's outputs
+        options.traceSink.path = flags.count("trace-out") ? flags["trace-out"] : "none";
+        options.traceSink.statsPath = flags.count("stats-out") ? flags["stats-out"] : "none";
+        options.traceSink.mmap = false;
+        rm.reset(new BasicRingMaster<ReplayTransport>(args[0], std::stoi(args[1]), std::stoi(args[2]), options));
+        rm->start();
+    } else if (log.getRole() == "player") {
+        if (args.size() < 2)
+            throw std::runtime_error("Wire log has a malformed player command line");
+        PlayerOptions options;
+        std::map<std::string, std::string> recorded = recordedFlags(args, 2);
+        applyPlayerFlags(options, recorded);
+        options.verbose = flags.count("verbose") && flags["verbose"] == "yes";
+        player.reset(new BasicPlayer<ReplayTransport>(args[0], args[1], options));
+        player->start();
+    } else {
+        std::cerr << "Unknown role " << log.getRole() << " in wire log\n";
+        return 1;
+    }
+
+    Replayer& replayer = Replayer::instance();
+    LatencyHistogram handlerTimes;
+    size_t numFrames = 0, numBytes = 0;
+
+    WireRecordHeader header;
+    const char* body;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (log.next(header, body)) {
+        if (header.direction != WireDirection::RECEIVED) continue;
+        if (recordedSpeed)
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(header.timeNs));
+
+        std::string frame(body, header.length);
+        std::chrono::steady_clock::time_point handlerStart = std::chrono::steady_clock::now();
+        replayer.deliver(header.timeNs, header.endpoint, header.connection, std::move(frame));
+        handlerTimes.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - handlerStart).count());
+
+        numFrames++;
+        numBytes += header.length;
+    }
+    std::chrono::duration<double> replayTime = std::chrono::steady_clock::now() - start;
+
+    std::cout.flush();
+    std::cout << "Replayed " << numFrames << " frames (" << numBytes << " bytes) into the " << log.getRole()
+              << " in " << replayTime.count() << " s, " << numFrames / replayTime.count() << " frames/s, "
+              << replayer.getNumSent() << " frames (" << replayer.getBytesSent() << " bytes) sent\n"
+              << "Handler time per frame, " << handlerTimes.report();
+}
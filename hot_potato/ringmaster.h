@@ -1,25 +1,183 @@
-#include "server.h"
+#include "transport.h"
 #include "commands.h"
+#include "trace_sink.h"
+#include "latency_histogram.h"
+#include "worker_pool.h"
+#include "checkpoint.h"
+#include "federation.h"
 #include <mutex>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <memory>
+
+struct RingMasterOptions {
+    TraceMode traceMode = TraceMode::IDS;
+    TraceSinkOptions traceSink;
+    // bytes of opaque payload carried by the potato
+    size_t payloadSize = 0;
+    TransportProfile profile;
+    // players listen on ringmaster port + 1 + id instead of a free port
+    bool fixedPlayerPorts = false;
+    // open loop injection: potatoes per second, 0 sends a single potato once
+    // every player is ready
+    double injectRate = 0;
+    size_t injectCount = 1;
+    // seeds the starting player and the payload bytes
+    unsigned int seed = (unsigned int) time(NULL);
+    // threads handling registration, 0 handles it on the server thread
+    size_t registrationWorkers = std::thread::hardware_concurrency();
+    // relay ring setup, readiness and shutdown through a tree of players with
+    // this many children per node, 0 talks to every player directly
+    size_t treeFanout = 0;
+    // keep a snapshot of the game in this file so a restarted ringmaster can
+    // resume it, empty for none
+    std::string checkpointPath;
+    // players report the potato every this many hops, 1000 if 0 and checkpointing
+    size_t checkpointHops = 0;
+    // the snapshot is rewritten at most this often
+    double checkpointSeconds = 1;
+    // let players join and leave mid game, with ids up to this many players;
+    // 0 keeps the ring as it started
+    size_t elasticPlayers = 0;
+    // how players pick the neighbour to pass to
+    RoutingPolicy routing = RoutingPolicy::RANDOM;
+    // federated games, see federation.h: this ringmaster coordinates segment
+    // of numSegments, 1 segment is the whole ring
+    size_t segment = 0, numSegments = 1;
+    // where the lead listens for the other ringmasters
+    std::string federationHost, federationPort;
+};
 
-class RingMaster {
+// "fixed" to true, "ephemeral" to false, see fixedPlayerPorts
+bool parsePlayerPorts(const std::string& str) {
+    if (str == "fixed") return true;
+    if (str == "ephemeral") return false;
+    throw std::runtime_error("Unknown player ports " + str);
+}
+
+// fills options from the command line flags shared by the ringmaster and the simulator
+void applyRingMasterFlags(RingMasterOptions& options, std::map<std::string, std::string>& flags) {
+    if (flags.count("trace")) options.traceMode = parseTraceMode(flags["trace"]);
+    if (flags.count("trace-out")) options.traceSink.path = flags["trace-out"];
+    if (flags.count("trace-format")) options.traceSink.format = parseTraceFormat(flags["trace-format"]);
+    if (flags.count("stats-out")) options.traceSink.statsPath = flags["stats-out"];
+    if (flags.count("stats-visits")) options.traceSink.listVisits = parseStatsVisits(flags["stats-visits"]);
+    if (flags.count("trace-mmap")) options.traceSink.mmap = parseTraceMmap(flags["trace-mmap"]);
+    applyProfileFlags(options.profile, flags);
+    if (flags.count("player-ports")) options.fixedPlayerPorts = parsePlayerPorts(flags["player-ports"]);
+    if (flags.count("rate")) options.injectRate = std::stod(flags["rate"]);
+    if (flags.count("count")) options.injectCount = std::stoull(flags["count"]);
+    if (flags.count("payload")) options.payloadSize = std::stoull(flags["payload"]);
+    if (flags.count("seed")) options.seed = (unsigned int) std::stoul(flags["seed"]);
+    if (flags.count("workers")) options.registrationWorkers = std::stoull(flags["workers"]);
+    if (flags.count("tree-fanout")) options.treeFanout = std::stoull(flags["tree-fanout"]);
+    if (flags.count("checkpoint")) options.checkpointPath = flags["checkpoint"];
+    if (flags.count("checkpoint-hops")) options.checkpointHops = std::stoull(flags["checkpoint-hops"]);
+    if (flags.count("checkpoint-every")) options.checkpointSeconds = std::stod(flags["checkpoint-every"]);
+    if (flags.count("elastic")) options.elasticPlayers = std::stoull(flags["elastic"]);
+    if (flags.count("routing")) options.routing = parseRoutingPolicy(flags["routing"]);
+    if (flags.count("segment")) std::tie(options.segment, options.numSegments) = parseSegment(flags["segment"]);
+    if (flags.count("federation")) std::tie(options.federationHost, options.federationPort) = parseHostPort(flags["federation"]);
+}
+
+// the options of the game a snapshot was taken of, over whatever the flags said
+void applySnapshotOptions(RingMasterOptions& options, const GameSnapshot& snapshot) {
+    options.seed = snapshot.seed;
+    options.traceMode = parseTraceMode(snapshot.traceMode);
+    options.payloadSize = snapshot.payloadSize;
+    options.treeFanout = snapshot.treeFanout;
+    options.checkpointHops = snapshot.checkpointHops;
+}
+
+template<typename Transport>
+class BasicRingMaster {
 
 public:
 
-    RingMaster(std::string _port, size_t _numPlayers, size_t _numHops) {
+    using Clock = typename Transport::Clock;
+
+    BasicRingMaster(std::string _port, size_t _numPlayers, size_t _numHops, RingMasterOptions _options = RingMasterOptions()) {
         // initialize the server
         port = _port;
         numPlayers = _numPlayers;
         numHops = _numHops;
-        server = Server<MAX_PLAYERS>(std::bind(&RingMaster::onMessage, this, std::placeholders::_1, std::placeholders::_2), port);
-        srand((unsigned int)time(NULL));
+        options = _options;
+        // a simulated transport runs every handler on the simulator's thread
+        if (!Transport::REAL_TIME)
+            options.registrationWorkers = 0;
+        if (options.checkpointPath.empty())
+            options.checkpointHops = 0;
+        else if (options.checkpointHops == 0)
+            options.checkpointHops = 1000;
+        // a checkpoint is of the one potato of a closed loop game
+        if (options.checkpointHops > 0 && options.injectRate > 0)
+            throw std::runtime_error("Checkpointing does not support open loop injection");
+        if (options.injectRate > 0 && options.injectCount == 0)
+            throw std::runtime_error("Open loop injection needs a count of one potato or more");
+        segmentStart = 0;
+        segmentSize = numPlayers;
+        if (federated()) {
+            if (options.numSegments > MAX_SEGMENTS || options.numSegments > numPlayers)
+                throw std::runtime_error("A federated game takes at most " + std::to_string(MAX_SEGMENTS) + " segments, of a player or more each");
+            if (options.federationPort.empty())
+                throw std::runtime_error("A federated game needs the address of the lead ringmaster");
+            if (options.elasticPlayers > 0 || options.treeFanout > 0 || options.checkpointHops > 0)
+                throw std::runtime_error("A federated game takes no elastic players, tree or checkpoints");
+            std::pair<size_t, size_t> range = splitRange(0, numPlayers, options.numSegments)[options.segment];
+            segmentStart = range.first;
+            segmentSize = range.second - range.first;
+        }
+        idSpace = segmentSize;
+        if (options.elasticPlayers > 0) {
+            if (options.elasticPlayers < numPlayers || options.elasticPlayers > MAX_PLAYERS)
+                throw std::runtime_error("An elastic game takes at most " + std::to_string(MAX_PLAYERS) + " players");
+            // a direction trace or a tree assumes ids go round the ring in order
+            if (options.traceMode != TraceMode::IDS || options.treeFanout > 0 || options.checkpointHops > 0)
+                throw std::runtime_error("An elastic game needs the ids trace, and no tree or checkpoints");
+            idSpace = options.elasticPlayers;
+        }
+        // sized once, so registration handlers on the pool never see them move
+        playerHostNames.resize(idSpace);
+        playerPorts.resize(idSpace);
+        for(size_t playerId = 0; playerId < idSpace; playerId++)
+            playerConnections.push_back(playerId);
+        nextOf.resize(idSpace);
+        prevOf.resize(idSpace);
+        departed.assign(idSpace, false);
+        for(size_t playerId = 0; playerId < segmentSize; playerId++) {
+            nextOf[playerId] = (playerId + 1) % segmentSize;
+            prevOf[playerId] = (playerId + segmentSize - 1) % segmentSize;
+            members.push_back(playerId);
+        }
+        server = PlayerServer(std::bind(&BasicRingMaster::onMessage, this, std::placeholders::_1, std::placeholders::_2), port, options.profile);
+        if (federated() && isLead()) {
+            peerServer = PeerServer(std::bind(&BasicRingMaster::onPeerMessage, this, std::placeholders::_1, std::placeholders::_2), options.federationPort, options.profile);
+            segmentHeads.resize(options.numSegments);
+            segmentConnections.resize(options.numSegments);
+        } else if (federated()) {
+            leadClient.reset(new PeerClient(std::bind(&BasicRingMaster::onPeerMessage, this, 0, std::placeholders::_1), options.federationHost, options.federationPort, options.profile));
+        }
+        srand(options.seed);
         done.store(false);
     }
 
-    ~RingMaster() {
+    ~BasicRingMaster() {
+        registrationPool.close();
+        traceSink.close();
     }
 
     void start() {
+        // the lead keeps the trace of the whole ring
+        if (isLead() && traceSink.start(options.traceSink, federated() ? numPlayers : idSpace) != 0)
+            throw std::runtime_error("Unable to open trace output");
+        if (leadClient && leadClient->start() != 0)
+            throw std::runtime_error("Unable to reach the lead ringmaster");
+        if (federated() && isLead() && peerServer.start() != 0)
+            throw std::runtime_error("Unable to listen for the other ringmasters");
+        if (options.registrationWorkers > 0)
+            registrationPool.start(options.registrationWorkers, std::bind(&BasicRingMaster::onRegistrationMessage, this, std::placeholders::_1, std::placeholders::_2));
         server.start();
         #ifdef DEBUG
         std::cout << "Server hostname: " << server.getServerInfo().first << '\n';
@@ -28,6 +186,25 @@ public:
         std::cout << "Potato Ringmaster\n";
         std::cout << "Players = " << numPlayers << '\n';
         std::cout << "Hops = " << numHops << '\n';
+        if (federated())
+            std::cout << "Segment " << options.segment << " of " << options.numSegments << ", players "
+                      << segmentStart << " to " << segmentStart + segmentSize - 1 << '\n';
+        if (resuming)
+            std::cout << "Resuming epoch " << epoch << ", waiting for the players to rejoin\n";
+    }
+
+    // picks up the game in saved instead of registering players, call before start
+    void resume(const GameSnapshot& saved) {
+        if (saved.numPlayers != numPlayers || saved.numHops != numHops)
+            throw std::runtime_error("Snapshot is of a game with other players or hops");
+        resuming = true;
+        // every id was handed out before the restart, the players rejoin instead of registering
+        numConnectedPlayers.store(numPlayers);
+        epoch = saved.epoch + 1;
+        playerHostNames = saved.hostNames;
+        playerPorts = saved.ports;
+        snapshot = saved;
+        checkpointedHops = snapshot.hasPotato ? std::stoull(split(snapshot.potatoArgs, TOKEN_DELIM)[0]) : 0;
     }
 
     void onMessage(size_t playerId, std::string message) {
@@ -35,18 +212,31 @@ public:
         std::cout << "Received command from player " << playerId << '\n';
         std::cout << "Attempting to lock\n";
         #endif
-        std::unique_lock<std::mutex> lock(forcedSerialReceive);
+        // setup messages are parsed and handled on the pool, in order per player
+        if (registrationPool.size() > 0 && !PotatoFrame::matches(message)) {
+            registrationPool.submit(playerId, std::move(message));
+            return;
+        }
+
+        CommandPacket commandPacket = CommandPacket::deserialize(message);
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(laneOf(commandPacket.commandType));
 
         #ifdef DEBUG
         std::cout << "Locked\n";
         #endif
         
-        onCommand(playerId, CommandPacket::deserialize(message));
+        onCommand(playerId, std::move(commandPacket));
         #ifdef DEBUG
         std::cout << "Unlocked\n";
         #endif
     };
 
+    // registration handlers only touch their own player's slots and atomic
+    // counters, the last player in to a phase starts the next one
+    void onRegistrationMessage(size_t playerId, std::string message) {
+        onCommand(playerId, CommandPacket::deserialize(message));
+    }
+
     void onCommand(size_t playerId, CommandPacket commandPacket) {
         switch(commandPacket.commandType) {
             case CommandType::PLAYER_REGISTER: 
@@ -64,13 +254,38 @@ public:
             case CommandType::GIVE_POTATO:
                 onReceivePotato(playerId, std::move(commandPacket));
                 break;
+
+            case CommandType::POTATO_CHECKPOINT:
+                onPotatoCheckpoint(playerId, std::move(commandPacket));
+                break;
+
+            case CommandType::PLAYER_REJOIN:
+                onPlayerRejoin(playerId, std::move(commandPacket));
+                break;
+
+            case CommandType::PLAYER_LEAVE:
+                onPlayerLeave(playerId, std::move(commandPacket));
+                break;
             
             case CommandType::RINGMASTER_SET_NEXT:
+            case CommandType::RINGMASTER_SET_TREE:
             case CommandType::RINGMASTER_ASSIGN_ID_PORT:
             case CommandType::RINGMASTER_SHUTDOWN:
+            case CommandType::RINGMASTER_RESUME:
                 throw std::runtime_error("Error, received ringmaster command");
                 break;
 
+            case CommandType::PLAYER_HELLO:
+            case CommandType::PLAYER_UNLINK:
+                throw std::runtime_error("Error, received player to player command");
+                break;
+
+            case CommandType::SEGMENT_HEAD:
+            case CommandType::SEGMENT_READY:
+            case CommandType::SEGMENT_POTATO:
+                throw std::runtime_error("Error, received ringmaster to ringmaster command from a player");
+                break;
+
             default:
                 throw std::runtime_error("Error, unhandled command.");
                 break;
@@ -83,7 +298,22 @@ public:
         std::cout << "Processing player debug\n";
         #endif 
 
-        numConnectedPlayers++;
+        if (resuming)
+            throw std::runtime_error("A new player registered with a resumed game");
+
+        size_t registration = numConnectedPlayers++;
+        if (registration >= idSpace) {
+            std::cerr << "Turning a player away, the game is full\n";
+            CommandPacket shutdownPacket{-1, CommandType::RINGMASTER_SHUTDOWN, {}};
+            server.message(playerId, shutdownPacket.serialize());
+            return;
+        }
+        // a player joining mid game gets the next unused id
+        size_t connectionId = playerId;
+        if (registration >= segmentSize) {
+            playerId = registration;
+            playerConnections[playerId] = connectionId;
+        }
 
         // assign a port to the player
         CommandPacket packet;
@@ -91,132 +321,655 @@ public:
         packet.author = -1;
         packet.commandType = CommandType::RINGMASTER_ASSIGN_ID_PORT;
 
-        int curPort = stoi(port);
-        int playerPort = curPort + 1 + playerId;
-        size_t prevId = (playerId + numPlayers - 1) % numPlayers;
+        int playerPort = 0;
+        if (options.fixedPlayerPorts)
+            playerPort = stoi(port) + 1 + playerId;
+        size_t prevId = (segmentStart + playerId + numPlayers - 1) % numPlayers;
 
-        packet.commandArgs.push_back(std::to_string(playerId));
+        packet.commandArgs.push_back(std::to_string(segmentStart + playerId));
         packet.commandArgs.push_back(std::to_string(playerPort));
         packet.commandArgs.push_back(std::to_string(prevId));
         packet.commandArgs.push_back(std::to_string(numPlayers));
+        if (options.checkpointHops > 0 || options.routing != RoutingPolicy::RANDOM)
+            packet.commandArgs.push_back(std::to_string(options.checkpointHops));
+        if (options.routing != RoutingPolicy::RANDOM)
+            packet.commandArgs.push_back(routingPolicyName(options.routing));
 
         
-        server.message(playerId, packet.serialize());
+        server.message(connectionId, packet.serialize());
     }
 
     void onReceivePotato(size_t playerId, CommandPacket commandPacket) {
+        // the lead checks it and keeps the trace
+        if (leadClient) {
+            leadClient->message(commandPacket.serialize(), Lane::DATA);
+            return;
+        }
+
         // if hops is non-zero, there is a bug, throw error
 
         Potato potato = Potato::parsePotato(commandPacket.commandArgs);
 
+        // still in flight when the previous ringmaster went down, it was resent from the checkpoint
+        if (potato.potatoId / POTATO_EPOCH_STRIDE != epoch)
+            return;
+        potato.potatoId %= POTATO_EPOCH_STRIDE;
+
         if (potato.numHops > 0)
             throw std::runtime_error("Got passed a still hot potato");
 
-        // if hops is zero, print messages, and shutdown
+        if (commandPacket.payload.size() != options.payloadSize || payloadChecksum(commandPacket.payload) != sentPayloadChecksum)
+            throw std::runtime_error("Potato payload was corrupted on the way");
 
-        std::cout << "Trace of potato:\n";
+        if (potato.potatoId >= intendedSend.size())
+            throw std::runtime_error("Got back a potato that was never sent");
 
-        bool first = true;
-        for(auto id: potato.ids) {
-            if (!first) std::cout << ",";
-            first = false;
-            std::cout << id;
-        }
-        std::cout << '\n';
+        // latency counts from when the potato was meant to leave, so a late
+        // injection does not hide the queueing that made it late
+        std::chrono::nanoseconds elapsed = Clock::now() - intendedSend[potato.potatoId];
+        latencies.record(elapsed.count());
 
-        shutdown();
+        // if hops is zero, hand the trace to the sink, and shutdown after the last one;
+        // an elastic ring only changes once the game is on
+        traceSink.submit(std::move(potato), elapsed, options.payloadSize, ringVersion > 0 ? 0 : numPlayers);
+
+        numPotatoesReturned++;
+        if (numPotatoesReturned == intendedSend.size()) {
+            if (options.injectRate > 0) {
+                std::chrono::duration<double> runTime = Clock::now() - intendedSend[0];
+                std::cout << "Open loop latency, target " << options.injectRate << " potatoes/s, achieved "
+                          << numPotatoesReturned / runTime.count() << " potatoes/s\n"
+                          << latencies.report();
+            }
+            // nothing left to resume
+            if (!options.checkpointPath.empty())
+                unlink(options.checkpointPath.c_str());
+            shutdown();
+        }
     }
 
     void onPlayerReady(size_t playerId, CommandPacket commandPacket) {
 
-        // on the last player ready, start the game
-        numPlayersReady++;
-
-        std::cout << "Player " << playerId << " is ready to play\n";
-        
-
-        if (numPlayersReady == numPlayers) {
-            size_t playerId = rand() % numPlayers;
-
-            std::cout << "Ready to start the game, sending the potato to player " << playerId << '\n';
+        // mid game it completes a step of a ring change
+        if (gameStarted.load()) {
+            std::unique_lock<LaneMutex> lock = lockGame();
+            onRingChangeStep(commandPacket.author);
+            return;
+        }
 
-            if (numHops == 0) {
-                shutdown();
-                std::cout << "Trace of potato:\n\n";
-                return;
+        // on the last player ready, start the game, or in a federated game
+        // tell the lead; in tree mode a player reports for its whole subtree,
+        // which is the range starting at it
+        size_t numReady = commandPacket.commandArgs.empty() ? 1 : std::stoull(commandPacket.commandArgs[0]);
+        size_t firstReady = segmentStart + playerId;
+        if (numReady == 1)
+            std::cout << "Player " + std::to_string(firstReady) + " is ready to play\n";
+        else
+            std::cout << "Players " + std::to_string(firstReady) + " to " + std::to_string(firstReady + numReady - 1) + " are ready to play\n";
+
+        if ((numPlayersReady += numReady) == segmentSize) {
+            std::unique_lock<LaneMutex> lock = lockGame();
+            if (leadClient) {
+                CommandPacket ready{-1, CommandType::SEGMENT_READY, {std::to_string(options.segment)}};
+                leadClient->message(ready.serialize());
+            } else if (federated()) {
+                onSegmentReady(options.segment);
             } else {
-                CommandPacket packet;
-                packet.author = -1;
-                packet.commandType = CommandType::GIVE_POTATO;
-                Potato potato;
-                potato.numHops = numHops;
-                packet.commandArgs = potato.serialize_to_vec();
-                
-                server.message(playerId, packet.serialize());
+                startGame();
             }
         }
     }
 
     void onPlayerReportAddr(size_t playerId, CommandPacket commandPacket) {
-        // on the last player report address, send out connection information
-        numConnectedPlayersReadyServers++;
+        // a joining player is wired in once the changes ahead of it are done
+        if ((size_t) commandPacket.author >= numPlayers) {
+            std::unique_lock<LaneMutex> lock = lockGame();
+            playerHostNames[commandPacket.author] = commandPacket.commandArgs[0];
+            playerPorts[commandPacket.author] = commandPacket.commandArgs[1];
+            pendingChanges.push_back(RingChange{true, (size_t) commandPacket.author, 0, 0});
+            tryStartRingChange();
+            return;
+        }
 
+        // on the last player report address, send out connection information
         std::pair<std::string, std::string> clientInfo = server.getClientInfo(playerId);
         playerHostNames[playerId] = commandPacket.commandArgs[0];
         playerPorts[playerId] = commandPacket.commandArgs[1];
 
-        // to all players on the next player
+        // to all players on the next player, the increment publishes the slots
+        // above to whichever handler brings in the last player
 
-        if (numConnectedPlayersReadyServers == numPlayers) {
-            for(size_t curPlayerId = 0; curPlayerId < numPlayers; curPlayerId++) {
-                size_t nextPlayerId = (curPlayerId+1) % numPlayers;
+        if (++numConnectedPlayersReadyServers == segmentSize) {
+            if (options.checkpointHops > 0) {
+                std::unique_lock<LaneMutex> lock = lockGame();
+                writeSnapshot();
+                scheduleSnapshot();
+            }
+            if (options.treeFanout > 0) {
+                for(const std::pair<size_t, size_t>& range: splitRange(0, numPlayers, options.treeFanout))
+                    server.message(range.first, setTreePacket(range.first, range.second).serialize());
+                return;
+            }
+            // the segment is wired once the lead knows where the next one starts
+            if (federated()) {
+                CommandPacket head{-1, CommandType::SEGMENT_HEAD, {std::to_string(options.segment), std::to_string(segmentStart), playerHostNames[0], playerPorts[0]}};
+                std::unique_lock<LaneMutex> lock = lockGame();
+                if (leadClient)
+                    leadClient->message(head.serialize());
+                else
+                    onSegmentHead(0, std::move(head));
+                return;
+            }
+            for(size_t curPlayerId = 0; curPlayerId < segmentSize; curPlayerId++)
+                server.message(curPlayerId, setNextPacket(curPlayerId).serialize());
+        }
+    }
 
-                CommandPacket packet;
-                packet.author = -1;
-                packet.commandType = CommandType::RINGMASTER_SET_NEXT;
-                packet.commandArgs.push_back(std::to_string(nextPlayerId));
-                
-                packet.commandArgs.push_back(playerHostNames[nextPlayerId]);
-                packet.commandArgs.push_back(playerPorts[nextPlayerId]);
+    void onPlayerLeave(size_t connectionId, CommandPacket commandPacket) {
+        std::unique_lock<LaneMutex> lock = lockGame();
+        if (options.elasticPlayers == 0) {
+            std::cerr << "Player " << commandPacket.author << " asked to leave, but the game is not elastic\n";
+            return;
+        }
+        pendingChanges.push_back(RingChange{false, (size_t) commandPacket.author, 0, 0});
+        tryStartRingChange();
+    }
+
+    // keeps the copy with the fewest hops left, in a closed loop game the newest
+    void onPotatoCheckpoint(size_t playerId, CommandPacket commandPacket) {
+        const std::vector<std::string>& args = commandPacket.commandArgs;
+        if (std::stoull(args[1]) / POTATO_EPOCH_STRIDE != epoch)
+            return;
+        size_t potatoHops = std::stoull(args[0]);
+
+        std::unique_lock<LaneMutex> lock = lockGame();
+        if (done.load() || (snapshot.hasPotato && potatoHops >= checkpointedHops))
+            return;
+        snapshot.hasPotato = true;
+        snapshot.potatoHolder = commandPacket.author;
+        snapshot.potatoArgs = concatenate(args, TOKEN_DELIM);
+        checkpointedHops = potatoHops;
+        snapshotDirty = true;
+    }
 
-                server.message(curPlayerId, packet.serialize());
+    // the players reconnect on their own, once all of them are back the
+    // game goes on from the last checkpoint
+    void onPlayerRejoin(size_t connectionId, CommandPacket commandPacket) {
+        if (!resuming)
+            throw std::runtime_error("A player rejoined a game that never stopped");
+        size_t playerId = std::stoull(commandPacket.commandArgs[0]);
+        if (playerId >= numPlayers)
+            throw std::runtime_error("Rejoining player id is out of range");
+        playerConnections[playerId] = connectionId;
+        std::cout << "Player " + std::to_string(playerId) + " rejoined\n";
+
+        if (++numPlayersRejoined == numPlayers) {
+            std::unique_lock<LaneMutex> lock = lockGame();
+            // the new epoch is on disk before any of its potatoes exist
+            writeSnapshot();
+            scheduleSnapshot();
+
+            CommandPacket resume{-1, CommandType::RINGMASTER_RESUME, {std::to_string(epoch)}};
+            for(size_t curPlayerId = 0; curPlayerId < numPlayers; curPlayerId++)
+                server.message(playerConnections[curPlayerId], resume.serialize());
+
+            payload = makePayload(options.payloadSize);
+            sentPayloadChecksum = payloadChecksum(payload);
+            intendedSend.assign(1, Clock::now());
+
+            if (snapshot.hasPotato) {
+                std::cout << "Resuming the game, sending the potato back to player " << snapshot.potatoHolder
+                          << " with " << checkpointedHops << " hops left\n";
+                resendCheckpoint();
+            } else {
+                size_t playerId = rand() % numPlayers;
+                std::cout << "Resuming the game from the start, sending the potato to player " << playerId << '\n';
+                sendPotato(0, playerId);
             }
         }
     }
 
+    // from the other ringmasters of a federated game, on the thread of the
+    // lead's peer server or of the connection to the lead, see federation.h
+    void onPeerMessage(size_t connectionId, std::string message) {
+        CommandPacket commandPacket = CommandPacket::deserialize(message);
+        std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(laneOf(commandPacket.commandType));
+
+        switch(commandPacket.commandType) {
+            case CommandType::SEGMENT_HEAD:
+                onSegmentHead(connectionId, std::move(commandPacket));
+                break;
+
+            case CommandType::SEGMENT_READY:
+                onSegmentReady(std::stoull(commandPacket.commandArgs[0]));
+                break;
+
+            case CommandType::SEGMENT_POTATO:
+                onSegmentPotato(std::move(commandPacket));
+                break;
+
+            // one that ended in another segment
+            case CommandType::GIVE_POTATO:
+                onReceivePotato(connectionId, std::move(commandPacket));
+                break;
+
+            case CommandType::RINGMASTER_SHUTDOWN:
+                shutdown();
+                break;
+
+            default:
+                throw std::runtime_error("Error, received player command from a ringmaster");
+                break;
+        }
+    }
+
+    // the lead collects every segment's head, then sends each the head of
+    // the one after it; a segment stitches itself to that one
+    void onSegmentHead(size_t connectionId, CommandPacket commandPacket) {
+        if (!isLead()) {
+            const std::vector<std::string>& args = commandPacket.commandArgs;
+            stitch(std::stoull(args[1]), args[2], args[3]);
+            return;
+        }
+
+        size_t segment = std::stoull(commandPacket.commandArgs[0]);
+        if (segment >= options.numSegments || !segmentHeads[segment].commandArgs.empty())
+            throw std::runtime_error("Segment " + std::to_string(segment) + " reported twice or does not exist");
+        segmentHeads[segment] = std::move(commandPacket);
+        segmentConnections[segment] = connectionId;
+        if (++numSegmentHeads < options.numSegments)
+            return;
+
+        for(size_t curSegment = 0; curSegment < options.numSegments; curSegment++) {
+            CommandPacket& next = segmentHeads[(curSegment + 1) % options.numSegments];
+            if (curSegment == options.segment)
+                stitch(std::stoull(next.commandArgs[1]), next.commandArgs[2], next.commandArgs[3]);
+            else
+                peerServer.message(segmentConnections[curSegment], next.serialize());
+        }
+    }
+
+    void onSegmentReady(size_t segment) {
+        if (!isLead())
+            throw std::runtime_error("Only the lead ringmaster starts the game");
+        std::cout << "Segment " + std::to_string(segment) + " is ready to play\n";
+        if (++numSegmentsReady == options.numSegments)
+            startGame();
+    }
+
+    void onSegmentPotato(CommandPacket commandPacket) {
+        size_t playerId = std::stoull(commandPacket.commandArgs[0]);
+        if (playerId < segmentStart || playerId >= segmentStart + segmentSize)
+            throw std::runtime_error("Got a potato for player " + std::to_string(playerId) + " of another segment");
+
+        CommandPacket packet;
+        packet.author = -1;
+        packet.commandType = CommandType::GIVE_POTATO;
+        packet.commandArgs.assign(commandPacket.commandArgs.begin() + 1, commandPacket.commandArgs.end());
+        packet.payload = std::move(commandPacket.payload);
+        server.message(playerConnections[playerId - segmentStart], packet.serialize(), Lane::DATA);
+    }
+
     bool isDone() {
         return done.load();
     }
 
 private:
 
+    bool federated() const {
+        return options.numSegments > 1;
+    }
+
+    // segment 0 leads, a game that is not federated is its own lead
+    bool isLead() const {
+        return options.segment == 0;
+    }
+
+    // with the game lock held
+    void stitch(size_t headId, std::string hostName, std::string port) {
+        successorId = headId;
+        successorHostName = hostName;
+        successorPort = port;
+        for(size_t playerId = 0; playerId < segmentSize; playerId++)
+            server.message(playerId, setNextPacket(playerId).serialize());
+    }
+
+    // handlers on the server thread already hold the game lock, pool threads take it here
+    std::unique_lock<LaneMutex> lockGame() {
+        std::unique_lock<LaneMutex> lock(forcedSerialReceive, std::defer_lock);
+        if (registrationPool.size() > 0) lock.lock();
+        return lock;
+    }
+
+    // with the game lock held
+    void writeSnapshot() {
+        snapshot.numPlayers = numPlayers;
+        snapshot.numHops = numHops;
+        snapshot.seed = options.seed;
+        snapshot.traceMode = traceModeName(options.traceMode);
+        snapshot.payloadSize = options.payloadSize;
+        snapshot.treeFanout = options.treeFanout;
+        snapshot.checkpointHops = options.checkpointHops;
+        snapshot.epoch = epoch;
+        snapshot.hostNames = playerHostNames;
+        snapshot.ports = playerPorts;
+        snapshot.save(options.checkpointPath);
+        snapshotDirty = false;
+    }
+
+    // rewrites the snapshot every checkpointSeconds if a checkpoint came in since
+    void scheduleSnapshot() {
+        std::chrono::duration<double> interval(options.checkpointSeconds);
+        snapshotTimer = server.scheduleAt(Clock::now() + std::chrono::duration_cast<typename Clock::duration>(interval), [this]() {
+            std::unique_lock<LaneMutex> lock(forcedSerialReceive);
+            snapshotTimer = 0;
+            if (done.load()) return;
+            if (snapshotDirty) writeSnapshot();
+            scheduleSnapshot();
+        });
+    }
+
+    // the checkpointed potato goes back to its holder as potato 0 of this epoch
+    void resendCheckpoint() {
+        CommandPacket packet;
+        packet.author = -1;
+        packet.commandType = CommandType::GIVE_POTATO;
+        packet.commandArgs = split(snapshot.potatoArgs, TOKEN_DELIM);
+        packet.commandArgs[1] = fixedWidth(epoch * POTATO_EPOCH_STRIDE, POTATO_ID_WIDTH);
+        packet.payload = payload;
+
+        server.message(playerConnections[snapshot.potatoHolder], packet.serialize(), Lane::DATA);
+    }
+
+    static std::string makePayload(size_t size) {
+        std::string payload(size, '\0');
+        for(size_t i = 0; i < size; i++)
+            payload[i] = (char) (rand() & 0xff);
+        return payload;
+    }
+
+    // every player of the ring is ready, with the game lock held
+    void startGame() {
+        gameStarted.store(true);
+        tryStartRingChange();
+        payload = makePayload(options.payloadSize);
+        sentPayloadChecksum = payloadChecksum(payload);
+
+        if (numHops > 0 && options.injectRate > 0) {
+            std::cout << "Ready to start the game, injecting " << options.injectCount
+                      << " potatoes at " << options.injectRate << " potatoes/s\n";
+            intendedSend.resize(options.injectCount);
+            injectStart = Clock::now();
+            scheduleInjection(0);
+            return;
+        }
+
+        size_t playerId = rand() % numPlayers;
+
+        std::cout << "Ready to start the game, sending the potato to player " << playerId << '\n';
+
+        if (numHops == 0) {
+            shutdown();
+            Potato potato;
+            potato.numHops = 0;
+            traceSink.submit(std::move(potato), std::chrono::nanoseconds(0), 0, numPlayers);
+            return;
+        } else {
+            intendedSend.assign(1, Clock::now());
+            sendPotato(0, playerId);
+        }
+    }
+
+    // Ringmaster_Set_Next pointing playerId at its next in the ring as it is now
+    CommandPacket setNextPacket(size_t playerId) {
+        size_t nextPlayerId = nextOf[playerId];
+
+        CommandPacket packet;
+        packet.author = -1;
+        packet.commandType = CommandType::RINGMASTER_SET_NEXT;
+        // the last player of a segment passes on to the next segment
+        if (federated() && playerId + 1 == segmentSize) {
+            packet.commandArgs.push_back(std::to_string(successorId));
+            packet.commandArgs.push_back(successorHostName);
+            packet.commandArgs.push_back(successorPort);
+            return packet;
+        }
+        packet.commandArgs.push_back(std::to_string(segmentStart + nextPlayerId));
+
+        packet.commandArgs.push_back(playerHostNames[nextPlayerId]);
+        packet.commandArgs.push_back(playerPorts[nextPlayerId]);
+        if (ringVersion > 0)
+            packet.commandArgs.push_back(std::to_string(ringVersion));
+        return packet;
+    }
+
+    // Ring changes go one at a time and only touch the neighbours where they
+    // happen, with the game lock held. A join first points the new player at
+    // its next and, once it is connected there, moves its prev on to it; a
+    // leave moves the leaving player's prev on to its next. Potatoes keep
+    // going round the old links until the new ones are up, see Player_Unlink.
+    void tryStartRingChange() {
+        while (!changeInProgress && gameStarted.load() && !done.load() && !pendingChanges.empty()) {
+            RingChange change = pendingChanges.front();
+            pendingChanges.pop_front();
+            size_t playerId = change.playerId;
+
+            if (change.join) {
+                size_t prevId = members[rand() % members.size()];
+                size_t nextId = nextOf[prevId];
+                ringVersion++;
+                nextOf[prevId] = playerId;
+                prevOf[playerId] = prevId;
+                nextOf[playerId] = nextId;
+                prevOf[nextId] = playerId;
+                members.push_back(playerId);
+                change.awaiting = playerId;
+                change.prevId = prevId;
+                std::cout << "Player " << playerId << " joins between players " << prevId << " and " << nextId << '\n';
+                server.message(playerConnections[playerId], setNextPacket(playerId).serialize());
+            } else {
+                std::vector<size_t>::iterator member = std::find(members.begin(), members.end(), playerId);
+                if (member == members.end())
+                    continue;
+                // a ring of two would have next and prev on the same connection
+                if (members.size() <= 3) {
+                    std::cerr << "Player " << playerId << " may not leave, the ring would be too small\n";
+                    continue;
+                }
+                size_t prevId = prevOf[playerId];
+                size_t nextId = nextOf[playerId];
+                ringVersion++;
+                nextOf[prevId] = nextId;
+                prevOf[nextId] = prevId;
+                members.erase(member);
+                departed[playerId] = true;
+                change.awaiting = prevId;
+                std::cout << "Player " << playerId << " leaves, player " << prevId << " passes to " << nextId << " instead\n";
+                server.message(playerConnections[prevId], setNextPacket(prevId).serialize());
+            }
+            currentChange = change;
+            changeInProgress = true;
+        }
+    }
+
+    void onRingChangeStep(size_t playerId) {
+        if (!changeInProgress || playerId != currentChange.awaiting)
+            throw std::runtime_error("Player " + std::to_string(playerId) + " is ready, but no ring change waits for it");
+        if (currentChange.join && playerId == currentChange.playerId) {
+            // the new player reached its next, its prev may pass to it now
+            currentChange.awaiting = currentChange.prevId;
+            server.message(playerConnections[currentChange.prevId], setNextPacket(currentChange.prevId).serialize());
+            return;
+        }
+        changeInProgress = false;
+        tryStartRingChange();
+    }
+
+    // Ringmaster_Set_Tree for the subtree heading [start, end)
+    CommandPacket setTreePacket(size_t start, size_t end) {
+        CommandPacket packet;
+        packet.author = -1;
+        packet.commandType = CommandType::RINGMASTER_SET_TREE;
+        packet.commandArgs.push_back(std::to_string(options.treeFanout));
+        packet.commandArgs.push_back(std::to_string(start));
+        packet.commandArgs.push_back(std::to_string(end));
+        for(size_t playerId = start; playerId <= end; playerId++) {
+            packet.commandArgs.push_back(playerHostNames[playerId % numPlayers]);
+            packet.commandArgs.push_back(playerPorts[playerId % numPlayers]);
+        }
+        return packet;
+    }
+
+    void sendPotato(size_t potatoId, size_t playerId) {
+        CommandPacket packet;
+        packet.author = -1;
+        packet.commandType = CommandType::GIVE_POTATO;
+        Potato potato;
+        potato.numHops = numHops;
+        potato.potatoId = epoch * POTATO_EPOCH_STRIDE + potatoId;
+        potato.traceMode = options.traceMode;
+        if (options.traceMode == TraceMode::DIRECTION_BITS) {
+            potato.directions.startId = playerId;
+            potato.directions.bitsPerHop = bitsForDegree(2);
+        }
+        packet.commandArgs = potato.serialize_to_vec();
+        packet.payload = payload;
+
+        // one starting in another segment goes through its ringmaster
+        if (federated()) {
+            size_t segment = segmentOf(playerId, numPlayers, options.numSegments);
+            if (segment != options.segment) {
+                packet.commandType = CommandType::SEGMENT_POTATO;
+                packet.commandArgs.insert(packet.commandArgs.begin(), std::to_string(playerId));
+                peerServer.message(segmentConnections[segment], packet.serialize(), Lane::DATA);
+                return;
+            }
+        }
+        server.message(playerConnections[playerId - segmentStart], packet.serialize(), Lane::DATA);
+    }
+
+    // sends injectCount potatoes on a fixed schedule, however many are still in
+    // flight; each send is a timer on the server's loop that schedules the next
+    void scheduleInjection(size_t potatoId) {
+        std::chrono::duration<double> interval(1.0 / options.injectRate);
+        typename Clock::time_point intended = injectStart + std::chrono::duration_cast<typename Clock::duration>(interval * (double) potatoId);
+
+        server.scheduleAt(intended, [this, potatoId, intended]() {
+            std::unique_lock<LaneMutex> lock = forcedSerialReceive.acquire(Lane::DATA);
+            if (done.load()) return;
+            intendedSend[potatoId] = intended;
+            sendPotato(potatoId, federated() ? rand() % numPlayers : members[rand() % members.size()]);
+            if (potatoId + 1 < options.injectCount) scheduleInjection(potatoId + 1);
+        });
+    }
+
     void shutdown() {
         CommandPacket shutdownPacket;
         shutdownPacket.author = -1;
         shutdownPacket.commandType = CommandType::RINGMASTER_SHUTDOWN;
-        for(size_t playerId = 0; playerId < numPlayers; playerId++) {
-            server.message(playerId, shutdownPacket.serialize());
+        if (options.treeFanout > 0) {
+            // the heads of the top level ranges relay it to everyone else
+            for(const std::pair<size_t, size_t>& range: splitRange(0, numPlayers, options.treeFanout))
+                server.message(playerConnections[range.first], shutdownPacket.serialize());
+        } else {
+            // every player given an id, joined yet or not, that has not left
+            size_t numIds = std::min(numConnectedPlayers.load(), idSpace);
+            for(size_t playerId = 0; playerId < numIds; playerId++) {
+                if (departed[playerId]) continue;
+                server.message(playerConnections[playerId], shutdownPacket.serialize());
+            }
         }
+        // the other segments shut down their own players
+        if (federated() && isLead()) {
+            for(size_t segment = 0; segment < options.numSegments; segment++)
+                if (segment != options.segment && !segmentHeads[segment].commandArgs.empty())
+                    peerServer.message(segmentConnections[segment], shutdownPacket.serialize());
+            peerServer.shutdown();
+        }
+        if (leadClient) leadClient->shutdown();
         done.store(true);
+        // a pending snapshot timer would otherwise hold a simulated game open
+        if (snapshotTimer != 0) server.cancel(snapshotTimer);
         server.shutdown();
         #ifdef DEBUG
         std::cout << "Finished shutdown messaging\n";
         #endif
     }
 
-    size_t numPlayersReady = 0;
-    size_t numConnectedPlayersReadyServers = 0;
-    size_t numConnectedPlayers = 0;
+    std::atomic<size_t> numPlayersReady{0};
+    std::atomic<size_t> numConnectedPlayersReadyServers{0};
+    std::atomic<size_t> numConnectedPlayers{0};
     size_t numPlayers;
     size_t numHops;
+    RingMasterOptions options;
+    TraceSink traceSink;
+    std::string payload;
+    uint64_t sentPayloadChecksum = 0;
+
+    // indexed by potato id
+    std::vector<typename Clock::time_point> intendedSend;
+    size_t numPotatoesReturned = 0;
+    LatencyHistogram latencies;
+    typename Clock::time_point injectStart;
 
     std::string port;
     
     static constexpr size_t MAX_PLAYERS = 169;
-    Server<MAX_PLAYERS> server;
-    std::string playerHostNames[MAX_PLAYERS], playerPorts[MAX_PLAYERS];
+    using PlayerServer = typename Transport::template Server<MAX_PLAYERS>;
+    PlayerServer server;
+    std::vector<std::string> playerHostNames, playerPorts;
+    // connection of each player, a resumed game learns them from Player_Rejoin
+    std::vector<size_t> playerConnections;
     std::atomic<bool> done;
 
-    std::mutex forcedSerialReceive;
+    // elastic games, see tryStartRingChange
+    struct RingChange {
+        bool join;
+        size_t playerId;
+        // the player whose Player_Ready completes the current step
+        size_t awaiting;
+        // a join's second step moves this player on to the new one
+        size_t prevId;
+    };
+    // ids go up to idSpace, members are the players in the ring in no order
+    size_t idSpace;
+    std::vector<size_t> nextOf, prevOf, members;
+    std::vector<bool> departed;
+    std::deque<RingChange> pendingChanges;
+    RingChange currentChange{false, 0, 0, 0};
+    bool changeInProgress = false;
+    size_t ringVersion = 0;
+    std::atomic<bool> gameStarted{false};
+
+    // checkpointing, see checkpoint.h; potatoes of older epochs are ignored
+    size_t epoch = 0;
+    bool resuming = false;
+    std::atomic<size_t> numPlayersRejoined{0};
+    GameSnapshot snapshot;
+    size_t checkpointedHops = 0;
+    bool snapshotDirty = false;
+    uint64_t snapshotTimer = 0;
+
+    // federated games, see federation.h: the ids of this segment start at
+    // segmentStart, everything above is indexed from 0 within the segment
+    size_t segmentStart = 0, segmentSize = 0;
+    using PeerServer = typename Transport::template Server<MAX_SEGMENTS>;
+    using PeerClient = typename Transport::Client;
+    // the lead listens for the others, which each connect to it
+    PeerServer peerServer;
+    std::unique_ptr<PeerClient> leadClient;
+    // the lead's, indexed by segment
+    std::vector<CommandPacket> segmentHeads;
+    std::vector<size_t> segmentConnections;
+    size_t numSegmentHeads = 0, numSegmentsReady = 0;
+    // the head of the segment after this one
+    size_t successorId = 0;
+    std::string successorHostName, successorPort;
+
+    // control handlers get it ahead of potatoes, see lanes.h
+    LaneMutex forcedSerialReceive;
+    WorkerPool registrationPool;
 };
 
+using RingMaster = BasicRingMaster<SocketTransport>;
+
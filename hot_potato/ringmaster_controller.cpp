@@ -5,8 +5,8 @@
 
 int main(int argc, char* argv[]) {
     
-    if (argc != 4) {
-        std::cout << "Usage: <port> <num players> <num hops>";
+    if (argc < 4 || argc % 2 != 0) {
+        std::cout << "Usage: <port> <num players> <num hops> [--trace ids|bits] [--trace-out <file>|-] [--trace-format text|csv|binary] [--trace-mmap yes|no] [--stats-out <file>|-] [--stats-visits summary|all] [--payload <bytes>] [--profile default|latency|throughput] [--batch-delay-us <us> --batch-size <potatoes>] [--spin-us <us>] [--connect-timeout-ms <ms>] [--idle-timeout-ms <ms>] [--cpus <list>|numa] [--player-ports ephemeral|fixed] [--rate <potatoes/s> --count <potatoes>] [--seed <seed>] [--workers <threads>] [--tree-fanout <children>] [--checkpoint <snapshot> --checkpoint-hops <hops> --checkpoint-every <seconds>] [--resume <snapshot>] [--elastic <max players>] [--routing random|load] [--segment <index>/<segments> --federation <lead host>:<port>] [--record <wire log>]";
         return 1;
     }
 
@@ -14,8 +14,35 @@ int main(int argc, char* argv[]) {
     size_t numPlayers = std::stoi(argv[2]);
     size_t numHops = std::stoi(argv[3]);
 
-    RingMaster rm(port, numPlayers, numHops);
+    RingMasterOptions options;
+    std::map<std::string, std::string> flags = parseFlags(argc, argv, 4);
+    applyRingMasterFlags(options, flags);
+    if (flags.count("cpus")) ThreadPlacement::instance().configure(flags["cpus"]);
+
+    GameSnapshot snapshot;
+    if (flags.count("resume")) {
+        if (snapshot.load(flags["resume"]) != 0)
+            return 1;
+        applySnapshotOptions(options, snapshot);
+        // go on checkpointing into the snapshot the game came from
+        if (options.checkpointPath.empty())
+            options.checkpointPath = flags["resume"];
+    }
+
+    if (flags.count("record")) {
+        // keep the seed so a replay makes the same payload
+        std::vector<std::string> args(argv + 1, argv + argc);
+        if (!flags.count("seed")) {
+            args.push_back("--seed");
+            args.push_back(std::to_string(options.seed));
+        }
+        if (WireRecorder::instance().open(flags["record"], "ringmaster", args) != 0)
+            return 1;
+    }
 
+    RingMaster rm(port, numPlayers, numHops, options);
+    if (flags.count("resume"))
+        rm.resume(snapshot);
 
     rm.start();
 
@@ -26,5 +53,5 @@ int main(int argc, char* argv[]) {
     while(!rm.isDone()) {
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
-
+    WireRecorder::instance().close();
 }
\ No newline at end of file
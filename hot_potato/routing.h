@@ -0,0 +1,74 @@
+#ifndef ROUTING
+#define ROUTING
+
+#include "common_defs.h"
+#include <stdexcept>
+
+constexpr static size_t LOAD_WIDTH = 4;
+// load fields wrap around at this
+constexpr static size_t LOAD_MODULUS = 10000;
+
+/*
+How a player picks the neighbour it passes a potato to:
+
+    RANDOM  a fair coin flip, the classic game
+    LOAD    power of two choices over what the player knows of its
+            neighbours' load: two distinct neighbours are sampled and the
+            potato goes to the less loaded one, a tie is a coin flip. With
+            the two neighbours of a ring both are always sampled.
+
+A neighbour's load is what the last potato it sent says: the potatoes queued
+at it then, plus the ones sent to it that it had not received yet, which its
+received count tells apart from those it had.
+*/
+
+enum class RoutingPolicy {
+    RANDOM = 0,
+    LOAD = 1,
+};
+
+RoutingPolicy parseRoutingPolicy(const std::string& str) {
+    if (str == "random") return RoutingPolicy::RANDOM;
+    if (str == "load") return RoutingPolicy::LOAD;
+    throw std::runtime_error("Unknown routing policy " + str);
+}
+
+std::string routingPolicyName(RoutingPolicy policy) {
+    return policy == RoutingPolicy::LOAD ? "load" : "random";
+}
+
+// what a player knows of the load of one neighbour, counts are mod LOAD_MODULUS
+struct NeighbourLoad {
+    size_t queued = 0;
+    size_t sent = 0, delivered = 0;
+    // potatoes received from the neighbour, echoed back to it
+    size_t received = 0;
+
+    size_t estimate() const {
+        return queued + (sent + LOAD_MODULUS - delivered) % LOAD_MODULUS;
+    }
+
+    void report(size_t load, size_t receivedFromUs) {
+        queued = load;
+        delivered = receivedFromUs;
+        received = (received + 1) % LOAD_MODULUS;
+    }
+
+    void onSend() {
+        sent = (sent + 1) % LOAD_MODULUS;
+    }
+};
+
+// index into loads of the neighbour to pass to
+size_t chooseNeighbour(RoutingPolicy policy, const NeighbourLoad* loads, size_t degree) {
+    if (policy == RoutingPolicy::RANDOM || degree < 2)
+        return rand() % degree;
+
+    size_t first = rand() % degree;
+    size_t second = (first + 1 + rand() % (degree - 1)) % degree;
+    size_t firstLoad = loads[first].estimate(), secondLoad = loads[second].estimate();
+    if (firstLoad == secondLoad) return rand() % 2 ? first : second;
+    return firstLoad < secondLoad ? first : second;
+}
+
+#endif
@@ -2,15 +2,22 @@
 #define SERVER
 
 #include "common_defs.h"
+#include "framing.h"
+#include "transport_profile.h"
+#include "wire_log.h"
+#include "timer_wheel.h"
+#include "busy_poll.h"
+#include "awaitable.h"
 
 template<size_t N>
 class Server {
 public:
     
     Server() = default;
-    Server(std::function<void(size_t, std::string)> _callback, std::string _port) {
+    Server(std::function<void(size_t, std::string)> _callback, std::string _port, TransportProfile _profile = TransportProfile()) {
         callback = _callback;
         port = _port;
+        profile = _profile;
         stop.store(false);
         initialized = true;
     }
@@ -25,6 +32,7 @@ public:
 
         server.initialized = false;
         port = server.port;
+        profile = server.profile;
         callback = std::move(server.callback);
         initialized = true;
         stop.store(false);
@@ -36,77 +44,66 @@ public:
         if (!stop.load())
             stop.store(true);
         
-        close(masterSocket);
+        if (masterSocket >= 0) close(masterSocket);
         for(size_t i = 0; i < N; i++)
             if (clientSockets[i] != 0) close(clientSockets[i]);
     }
 
+    // whatever is still queued goes out first, the last messages before a
+    // shutdown are usually the ones telling the peers to stop
     void shutdown() {
+        for(size_t i = 0; i < N; i++)
+            if (clientSockets[i] > 0 && sendQueues[i].hasPending()) sendQueues[i].drain(clientSockets[i]);
         stop.store(true);
     }
 
-    void message(size_t client_id, std::string message) {
+    // queued in its lane if the socket cannot take it right away, see lanes.h
+    void message(size_t client_id, std::string message, Lane lane = Lane::CONTROL) {
         #ifdef DEBUG
         std::cout << "Attempting to send message to " << client_id << "\n";
         #endif 
         
-        status_t status = write(clientSockets[client_id], message.c_str(), message.size()+1);
-        if (status <= 0) {
+        if (WireRecorder::instance().isRecording())
+            WireRecorder::instance().record(endpoint, client_id, WireDirection::SENT, message);
+        uint64_t openedBatch = 0;
+        status_t status = sendQueues[client_id].send(clientSockets[client_id], std::move(message), lane, &openedBatch);
+        if (openedBatch != 0) {
+            timers.scheduleAt(LoopTimers::Clock::now() + std::chrono::microseconds(profile.batchDelayUs), [this, client_id, openedBatch]() {
+                if (sendQueues[client_id].closeBatch(clientSockets[client_id], openedBatch) != 0)
+                    std::cerr << "Error on write\n";
+            });
+            // the loop may be waiting on a later deadline
+            wakeup.wake();
+        }
+        if (sendQueues[client_id].hasPending()) wakeup.wake();
+        if (status != 0) {
             std::cerr << "Error on write\n";
         }
     }
 
+    // runs callback on the server's thread at or soon after when, from any thread
+    TimerWheel::TimerId scheduleAt(LoopTimers::Clock::time_point when, TimerWheel::Callback callback) {
+        return timers.scheduleAt(when, std::move(callback));
+    }
+
+    bool cancel(TimerWheel::TimerId id) {
+        return timers.cancel(id);
+    }
+
     int start() {
         if (!initialized)
             throw std::runtime_error("Not initialized!");
-        status_t status;
-        struct addrinfo host_info, *host_info_list;
+        endpoint = WireRecorder::instance().attach();
+        for(size_t i = 0; i < N; i++)
+            sendQueues[i].setBatchSize(batchRecords(profile));
         // reset client sockets
         memset(clientSockets, 0, N*sizeof(clientSockets[0]));
-        memset(&host_info, 0, sizeof(host_info));
-
-        // get host information
-        host_info.ai_family = AF_UNSPEC;
-        host_info.ai_socktype = SOCK_STREAM;
-        host_info.ai_flags = AI_PASSIVE;
-
-        status = getaddrinfo(NULL, port.c_str(), &host_info, &host_info_list);
-        if (status != 0) {
-            std::cerr << "Error: Cannot get address info for host" << std::endl;
-            return -1;
-        }
 
-        // make master socket
-        masterSocket = socket(host_info_list->ai_family,
-                           host_info_list->ai_socktype,
-                           host_info_list->ai_protocol);
-        if (masterSocket < 0) {
-            std::cerr << "Error on getting master socket with error: " << strerror(errno) <<"\n";
-            std::cerr << "masterSocket number: " << masterSocket << '\n';
+        // an IPv6 socket takes both IPv4 and IPv6 peers, fall back to whatever
+        // the host has if it cannot make or bind one
+        if (listenOn(AF_INET6, false) != 0 && listenOn(AF_UNSPEC, true) != 0)
             return -1;
-        }
-
-        int yes = 1;
-        status = setsockopt(masterSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
-        if (status != 0) {
-            std::cerr << "Error on set socket options\n";
-            return -1;
-        }
-        status = bind(masterSocket, host_info_list->ai_addr, host_info_list->ai_addrlen);
-
-        if (status == -1) {
-            std::cerr << "Error: Cannot bind socket" << std::endl;
-            return -1;
-        }
-
-        status = listen(masterSocket, N);
-        if (status == -1) {
-            std::cerr << "Error: cannot listen on socket" << std::endl;
-            return -1;
-        }
-
-        freeaddrinfo(host_info_list);
         mainServerThread = std::thread(std::bind(&Server::main, this));
         mainServerThread.detach();
         return 0;
@@ -117,23 +114,14 @@ public:
             throw std::runtime_error("Server is not initialized or not started.");
         }
 
-        struct sockaddr_in addr;
+        struct sockaddr_storage addr;
         socklen_t len = sizeof(addr);
         // Use getsockname to fill addr with the server's socket address
         if (getsockname(masterSocket, (struct sockaddr*)&addr, &len) == -1) {
             throw std::runtime_error("Failed to get socket name: " + std::string(strerror(errno)));
         }
 
-        // Convert IP address to string
-        char ipStr[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &addr.sin_addr, ipStr, sizeof(ipStr)) == nullptr) {
-            throw std::runtime_error("Failed to convert IP address to string: " + std::string(strerror(errno)));
-        }
-
-        // Convert port number from network byte order to host byte order
-        auto port = ntohs(addr.sin_port);
-        
-        return {ipStr, std::to_string(port)};
+        return describeAddress(addr);
     }
 
     // returns (ip, port)
@@ -142,7 +130,7 @@ public:
             throw std::runtime_error("Server is not initialized or not started");
         }
 
-        sockaddr_in clientAddr;
+        sockaddr_storage clientAddr;
         socklen_t clientAddrLen = sizeof(clientAddr);
 
         memset(&clientAddr, 0, sizeof(clientAddr));
@@ -153,27 +141,123 @@ public:
             throw std::runtime_error("Failred to get client info.");
         }
 
-        char ipStr[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &clientAddr.sin_addr, ipStr, sizeof(ipStr)) == nullptr) {
-            throw std::runtime_error("Failed to convert IP address");
-        }
-
-        int port = ntohs(clientAddr.sin_port);
-        return {ipStr, std::to_string(port)};
+        return describeAddress(clientAddr);
     }
 
     size_t getNumConnections() const {
         return numConnections.load();
     }
+
+    // the id of the next connection accepted, see awaitable.h
+    Awaitable<size_t> accept() {
+        return Awaitable<size_t>([this](std::function<void(size_t)> onAccepted) {
+            acceptors.add(std::move(onAccepted));
+        });
+    }
+
+    // the next frame read on a connection goes to the awaiting coroutine
+    // instead of the callback; an empty frame if the connection closes first
+    Awaitable<std::string> receive(size_t clientId) {
+        return Awaitable<std::string>([this, clientId](std::function<void(std::string)> onFrame) {
+            receivers[clientId].add(std::move(onFrame));
+        });
+    }
     
 private:
+    // opens masterSocket listening on port, on failure leaves it closed and
+    // says why if report is set
+    int listenOn(int family, bool report) {
+        status_t status;
+        struct addrinfo host_info, *host_info_list;
+        memset(&host_info, 0, sizeof(host_info));
+
+        // get host information
+        host_info.ai_family = family;
+        host_info.ai_socktype = SOCK_STREAM;
+        host_info.ai_flags = AI_PASSIVE;
+
+        status = getaddrinfo(NULL, port.c_str(), &host_info, &host_info_list);
+        if (status != 0) {
+            if (report) std::cerr << "Error: Cannot get address info for host" << std::endl;
+            return -1;
+        }
+
+        // make master socket
+        masterSocket = socket(host_info_list->ai_family,
+                              host_info_list->ai_socktype,
+                              host_info_list->ai_protocol);
+        if (masterSocket < 0) {
+            if (report) {
+                std::cerr << "Error on getting master socket with error: " << strerror(errno) <<"\n";
+                std::cerr << "masterSocket number: " << masterSocket << '\n';
+            }
+            freeaddrinfo(host_info_list);
+            return -1;
+        }
+
+        if (host_info_list->ai_family == AF_INET6) {
+            int no = 0;
+            setsockopt(masterSocket, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+        }
+
+        int yes = 1;
+        status = setsockopt(masterSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+        if (status != 0) {
+            if (report) std::cerr << "Error on set socket options\n";
+            return closeMaster(host_info_list);
+        }
+
+        if (applySocketProfile(masterSocket, profile) != 0)
+            return closeMaster(host_info_list);
+
+        status = bind(masterSocket, host_info_list->ai_addr, host_info_list->ai_addrlen);
+
+        if (status == -1) {
+            if (report) std::cerr << "Error: Cannot bind socket" << std::endl;
+            return closeMaster(host_info_list);
+        }
+
+        status = listen(masterSocket, profile.listenBacklog > 0 ? profile.listenBacklog : N);
+        if (status == -1) {
+            if (report) std::cerr << "Error: cannot listen on socket" << std::endl;
+            return closeMaster(host_info_list);
+        }
+
+        freeaddrinfo(host_info_list);
+        return 0;
+    }
+
+    // as Client::checkIdle, for connection clientId
+    void checkIdle(size_t clientId) {
+        idleTimers[clientId] = 0;
+        if (clientSockets[clientId] <= 0) return;
+        LoopTimers::Clock::time_point idleAt = lastRead[clientId] + std::chrono::milliseconds(profile.idleTimeoutMs);
+        if (LoopTimers::Clock::now() < idleAt) {
+            idleTimers[clientId] = timers.scheduleAt(idleAt, [this, clientId]() { checkIdle(clientId); });
+            return;
+        }
+        std::cerr << "Nothing read from connection " << clientId << " for " << profile.idleTimeoutMs << " ms, closing it\n";
+        ::shutdown(clientSockets[clientId], SHUT_RDWR);
+    }
+
+    // undoes a failed listenOn
+    int closeMaster(struct addrinfo* host_info_list) {
+        close(masterSocket);
+        masterSocket = -1;
+        freeaddrinfo(host_info_list);
+        return -1;
+    }
+
 
     void main() {
         struct sockaddr_in address;
         int addrlen = sizeof(address);
         status_t status;
         socketfd_t max_socket;
-        fd_set readfds;
+        fd_set readfds, writefds;
+        PinnedThread pinned;
+        SpinBudget spin(profile.spinUs);
 
         // #ifdef DEBUG
         // int cnter = 0;
@@ -186,24 +270,29 @@ private:
             //     std::cout << "Checking connection\n";
             // #endif
             FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
 
             FD_SET(masterSocket, &readfds);
+            FD_SET(wakeup.fd(), &readfds);
 
-            max_socket = masterSocket;
+            max_socket = std::max(masterSocket, wakeup.fd());
 
             for(size_t i = 0; i < N; i++) {
                 if (clientSockets[i] > 0) {
                     FD_SET(clientSockets[i], &readfds);
+                    if (sendQueues[i].hasPending())
+                        FD_SET(clientSockets[i], &writefds);
                     if (clientSockets[i] > max_socket)
                         max_socket = clientSockets[i];
                 }
             }
 
-            struct timeval timeout;
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 1000;
+            // wake up for the next timer, and at least every millisecond to check stop
+            struct timeval timeout = spin.timeout(timers.timeout(std::chrono::microseconds(1000)));
 
-            status = select(max_socket+1, &readfds, NULL, NULL, &timeout);
+            status = select(max_socket+1, &readfds, &writefds, NULL, &timeout);
+            spin.onSelect(status);
+            timers.run();
 
             if (status == -1) {
                 if (stop.load()) {
@@ -213,28 +302,42 @@ private:
                 }
             }
 
+            if (FD_ISSET(wakeup.fd(), &readfds)) wakeup.clear();
+
             // new connection
             if (FD_ISSET(masterSocket, &readfds)) {
-                socketfd_t new_socket = accept(masterSocket,
+                socketfd_t new_socket = ::accept(masterSocket,
                                                (struct sockaddr *)&address, (socklen_t*)&addrlen);
                 if (new_socket < 0) {
                     std::cerr << "Error accepting new socket\n";
                     break;
                 }
+                applySocketProfile(new_socket, profile);
                 
-                for(size_t i = 0; i < N; i++) {
-                    if (clientSockets[i] == 0) {
-                        #ifdef DEBUG
-                        std::cout << "new client accepted with socket " << new_socket << '\n';
-                        #endif 
-                        
-                        clientSockets[i] = new_socket;
-                        numConnections++;
-                        break;
-                    }
-                    if (i == N-1) {
-                        throw std::runtime_error("Server connection limit exceeded");
-                    }
+                size_t i = 0;
+                while (i < N && clientSockets[i] != 0) i++;
+                if (i < N) {
+                    #ifdef DEBUG
+                    std::cout << "new client accepted with socket " << new_socket << '\n';
+                    #endif 
+                    
+                    clientSockets[i] = new_socket;
+                    numConnections++;
+                    lastRead[i] = LoopTimers::Clock::now();
+                    if (profile.idleTimeoutMs > 0) checkIdle(i);
+                    acceptors.offer(i);
+                } else {
+                    // a full server turns the connection away and keeps serving the others
+                    std::cerr << "Server connection limit of " << N << " reached, refusing a connection\n";
+                    close(new_socket);
+                }
+            }
+
+            // queued frames the sockets can take now
+            for(size_t i = 0; i < N; i++) {
+                if (clientSockets[i] > 0 && FD_ISSET(clientSockets[i], &writefds)) {
+                    if (sendQueues[i].flush(clientSockets[i]) != 0)
+                        std::cerr << "Error on write\n";
                 }
             }
 
@@ -245,35 +348,68 @@ private:
                     #ifdef DEBUG
                     std::cout << "Attempting to read socket " << clientSockets[i] << '\n';
                     #endif
-                    status_t amount_read = read(clientSockets[i], buffer, BUFFER_SIZE);
+                    status_t amount_read = readers[i].readFrom(clientSockets[i], buffer, BUFFER_SIZE,
+                        [this, i](std::string frame, Lane lane) {
+                            received.add(i, std::move(frame), lane);
+                        });
                     #ifdef DEBUG
                     std::cout << "Finished reading socket " << clientSockets[i] << " with " << amount_read << " bytes\n";
                     #endif
                     if (amount_read == 0) {
                         close(clientSockets[i]);
                         clientSockets[i] = 0;
+                        readers[i].reset();
+                        sendQueues[i].reset();
+                        timers.cancel(idleTimers[i]);
+                        idleTimers[i] = 0;
                         numConnections--;
+                        closed.push_back(i);
                     } else if (amount_read < 0) {
                         if (stop.load()) break;
-                    } else {
-                        #ifdef DEBUG
-                        std::cout << "Processing read content, attempting to callback\n";
-                        #endif
-                        buffer[amount_read] = char(0);
-
-                        callback(i, std::string(buffer));
+                    } else if (clientSockets[i] > 0) {
+                        lastRead[i] = LoopTimers::Clock::now();
+                        rearmAfterRead(clientSockets[i], profile);
                     }
                 }
             }
+
+            received.dispatch([this](size_t clientId, std::string frame) {
+                #ifdef DEBUG
+                std::cout << "Processing read frame, attempting to callback\n";
+                #endif
+                if (WireRecorder::instance().isRecording())
+                    WireRecorder::instance().record(endpoint, clientId, WireDirection::RECEIVED, frame);
+                if (!receivers[clientId].offer(frame)) callback(clientId, std::move(frame));
+            });
+
+            // after the frames read before the close
+            for(size_t clientId: closed)
+                receivers[clientId].finishAll(std::string());
+            closed.clear();
         }
     }
-    socketfd_t masterSocket, clientSockets[N];
+    socketfd_t masterSocket = -1, clientSockets[N] = {};
     std::string port;
-    char buffer[BUFFER_SIZE+1];
+    TransportProfile profile;
+    char buffer[BUFFER_SIZE];
+    FrameReader readers[N];
+    SendQueue sendQueues[N];
+    LoopWakeup wakeup;
+    LaneDispatcher<size_t> received;
+    Waiters<size_t> acceptors;
+    Waiters<std::string> receivers[N];
+    // connections that closed this time round the loop
+    std::vector<size_t> closed;
+    uint32_t endpoint = 0;
+    LoopTimers timers;
+    // the idle check of each connection, cancelled when it closes so a
+    // later connection in the slot starts its own
+    LoopTimers::Clock::time_point lastRead[N];
+    TimerWheel::TimerId idleTimers[N] = {};
 
     std::function<void(size_t, std::string)> callback;
     std::atomic<bool> stop;
-    std::atomic<size_t> numConnections;
+    std::atomic<size_t> numConnections{0};
 
     std::thread mainServerThread;
     bool initialized = false;
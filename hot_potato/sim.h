@@ -0,0 +1,488 @@
+#ifndef SIM
+#define SIM
+
+#include "common_defs.h"
+#include "transport_profile.h"
+#include "lanes.h"
+#include "awaitable.h"
+#include <chrono>
+#include <deque>
+#include <queue>
+#include <random>
+#include <unordered_set>
+
+/*
+Discrete event simulation of the transport, so the real Player and
+RingMaster state machines can run without sockets or threads:
+
+    Simulator   virtual clock plus a priority queue of events, ordered by
+                time and then by scheduling order
+    SimServer,
+    SimClient   drop-in replacements for Server and Client, a message becomes
+                an event that delivers it to the peer's callback
+    LinkModel   one way latency, jitter and bandwidth of a link; a link sends
+                one message at a time, the ones waiting for it go control
+                lane first and in order within a lane
+
+Everything runs on the thread calling Simulator::run, a simulated ring is
+deterministic for a given seed.
+*/
+
+struct LinkModel {
+    uint64_t latencyNs = 50000;
+    // uniformly distributed extra latency in [0, jitterNs]
+    uint64_t jitterNs = 0;
+    // 0 is unlimited
+    double bytesPerSecond = 0;
+};
+
+class SimServerBase;
+class SimClient;
+
+class Simulator {
+public:
+
+    static Simulator& instance() {
+        static Simulator simulator;
+        return simulator;
+    }
+
+    uint64_t now() const {
+        return currentTime;
+    }
+
+    size_t numEventsRun() const {
+        return eventsRun;
+    }
+
+    void seed(uint64_t seed) {
+        random.seed(seed);
+    }
+
+    void setDefaultLinkModel(LinkModel model) {
+        defaultModel = model;
+    }
+
+    // model for the links into the server listening on port
+    void setLinkModel(const std::string& port, LinkModel model) {
+        portModels[port] = model;
+    }
+
+    const LinkModel& linkModel(const std::string& port) const {
+        auto found = portModels.find(port);
+        return found != portModels.end() ? found->second : defaultModel;
+    }
+
+    // returns an id for cancel
+    uint64_t scheduleAt(uint64_t time, std::function<void()> event) {
+        events.push(Event{std::max(time, currentTime), nextSequence, std::move(event)});
+        return nextSequence++;
+    }
+
+    void cancel(uint64_t id) {
+        cancelled.insert(id);
+    }
+
+    // a message waiting for its link
+    struct Transmission {
+        size_t size;
+        std::function<void()> deliver;
+    };
+
+    // one direction of a connection
+    struct Link {
+        uint64_t busyUntil = 0;
+        uint64_t lastArrival = 0;
+        std::deque<Transmission> waiting[NUM_LANES];
+    };
+
+    // sends a message of size bytes over link, deliver runs when it arrives;
+    // links must stay where they are until everything sent on them arrived
+    void transmit(Link& link, const LinkModel& model, size_t size, Lane lane, std::function<void()> deliver) {
+        bool idle = true;
+        for(const std::deque<Transmission>& waiting: link.waiting) idle = idle && waiting.empty();
+        if (idle && link.busyUntil <= currentTime) {
+            startTransmission(link, model, size, std::move(deliver));
+            return;
+        }
+        // otherwise the next start is scheduled already, unless this is the first to wait
+        link.waiting[(size_t) lane].push_back(Transmission{size, std::move(deliver)});
+        if (idle) scheduleAt(link.busyUntil, [this, &link, &model]() { startNextTransmission(link, model); });
+    }
+
+    // runs events until stop() holds or none are left, returns whether stop() held
+    template<typename Stop>
+    bool runUntil(Stop stop) {
+        while (!stop()) {
+            if (events.empty()) return false;
+            Event event = std::move(const_cast<Event&>(events.top()));
+            events.pop();
+            if (!cancelled.empty() && cancelled.erase(event.sequence) > 0) continue;
+            currentTime = event.time;
+            eventsRun++;
+            event.action();
+        }
+        return true;
+    }
+
+    void run() {
+        runUntil([]() { return false; });
+    }
+
+    int bind(const std::string& port, SimServerBase* server, std::string& boundPort) {
+        boundPort = port;
+        if (boundPort == "0") {
+            while (servers.count(std::to_string(nextPort))) nextPort++;
+            boundPort = std::to_string(nextPort++);
+        }
+        if (servers.count(boundPort)) return -1;
+        servers[boundPort] = server;
+        return 0;
+    }
+
+    void unbind(const std::string& port) {
+        servers.erase(port);
+    }
+
+    SimServerBase* lookup(const std::string& port) {
+        auto found = servers.find(port);
+        return found != servers.end() ? found->second : nullptr;
+    }
+
+private:
+    void startTransmission(Link& link, const LinkModel& model, size_t size, std::function<void()> deliver) {
+        uint64_t sendTime = model.bytesPerSecond > 0 ? (uint64_t) (size * 1e9 / model.bytesPerSecond) : 0;
+        link.busyUntil = currentTime + sendTime;
+
+        uint64_t jitter = model.jitterNs > 0 ? random() % (model.jitterNs + 1) : 0;
+        uint64_t arrival = link.busyUntil + model.latencyNs + jitter;
+        // a stream never reorders, jitter only ever delays
+        link.lastArrival = std::max(arrival, link.lastArrival);
+        scheduleAt(link.lastArrival, std::move(deliver));
+    }
+
+    // the link is free again
+    void startNextTransmission(Link& link, const LinkModel& model) {
+        for(std::deque<Transmission>& waiting: link.waiting) {
+            if (waiting.empty()) continue;
+            Transmission next = std::move(waiting.front());
+            waiting.pop_front();
+            startTransmission(link, model, next.size, std::move(next.deliver));
+            break;
+        }
+        for(const std::deque<Transmission>& waiting: link.waiting) {
+            if (!waiting.empty()) {
+                scheduleAt(link.busyUntil, [this, &link, &model]() { startNextTransmission(link, model); });
+                break;
+            }
+        }
+    }
+
+    struct Event {
+        uint64_t time;
+        uint64_t sequence;
+        std::function<void()> action;
+
+        bool operator>(const Event& other) const {
+            if (time != other.time) return time > other.time;
+            return sequence > other.sequence;
+        }
+    };
+
+    uint64_t currentTime = 0, nextSequence = 0;
+    size_t eventsRun = 0;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::unordered_set<uint64_t> cancelled;
+
+    LinkModel defaultModel;
+    std::map<std::string, LinkModel> portModels;
+    std::mt19937_64 random;
+
+    std::map<std::string, SimServerBase*> servers;
+    size_t nextPort = 10000;
+};
+
+// std::chrono clock reading the simulator's virtual time
+struct SimClock {
+    using rep = int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<SimClock>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() {
+        return time_point(duration(Simulator::instance().now()));
+    }
+};
+
+class SimServerBase {
+public:
+
+    SimServerBase() = default;
+    SimServerBase(std::function<void(size_t, std::string)> _callback, std::string _port, TransportProfile _profile = TransportProfile()) {
+        callback = _callback;
+        port = _port;
+        initialized = true;
+    }
+
+    SimServerBase& operator=(SimServerBase&& server) {
+        if (this->initialized)
+            throw std::runtime_error("Trying to initialize an initialized server");
+        if (!server.initialized)
+            throw std::runtime_error("Trying to initialize w/ uninitialized server");
+        if (server.started)
+            throw std::runtime_error("Trying to initialize w/ a running server");
+
+        server.initialized = false;
+        port = server.port;
+        callback = std::move(server.callback);
+        initialized = true;
+        return *this;
+    }
+
+    ~SimServerBase() {
+        if (started) Simulator::instance().unbind(port);
+    }
+
+    int start() {
+        if (!initialized)
+            throw std::runtime_error("Not initialized!");
+        if (Simulator::instance().bind(port, this, port) != 0) {
+            std::cerr << "Error: Cannot bind simulated port " << port << std::endl;
+            return -1;
+        }
+        started = true;
+        return 0;
+    }
+
+    void shutdown() {
+        stopped = true;
+    }
+
+    uint64_t scheduleAt(SimClock::time_point when, std::function<void()> callback) {
+        return Simulator::instance().scheduleAt(when.time_since_epoch().count(), std::move(callback));
+    }
+
+    void cancel(uint64_t id) {
+        Simulator::instance().cancel(id);
+    }
+
+    // a client connecting, returns its connection id
+    size_t accept(SimClient* client) {
+        peers.push_back(client);
+        links.emplace_back();
+        inbound.emplace_back();
+        receivers.emplace_back();
+        size_t connectionId = peers.size() - 1;
+        // the connecting side may be in a handler of the awaiting player
+        if (!acceptors.empty())
+            scheduleAt(SimClock::now(), [this, connectionId]() {
+                size_t accepted = connectionId;
+                acceptors.offer(accepted);
+            });
+        return connectionId;
+    }
+
+    // see Server
+    Awaitable<size_t> accept() {
+        return Awaitable<size_t>([this](std::function<void(size_t)> onAccepted) {
+            acceptors.add(std::move(onAccepted));
+        });
+    }
+
+    Awaitable<std::string> receive(size_t clientId) {
+        return Awaitable<std::string>([this, clientId](std::function<void(std::string)> onFrame) {
+            receivers[clientId].add(std::move(onFrame));
+        });
+    }
+
+    inline void message(size_t clientId, std::string message, Lane lane = Lane::CONTROL);
+
+    void deliver(size_t clientId, std::string message) {
+        if (!stopped && !receivers[clientId].offer(message)) callback(clientId, std::move(message));
+    }
+
+    Simulator::Link& inboundLink(size_t clientId) {
+        return inbound[clientId];
+    }
+
+    const std::string& getPort() const {
+        return port;
+    }
+
+    std::pair<std::string, std::string> getServerInfo() {
+        if (!started)
+            throw std::runtime_error("Server is not initialized or not started.");
+        return {"sim", port};
+    }
+
+    std::pair<std::string, std::string> getClientInfo(size_t clientId) {
+        return {"sim", std::to_string(clientId)};
+    }
+
+    size_t getNumConnections() const {
+        return peers.size();
+    }
+
+private:
+    // moves the message into the client's callback when the event runs
+    struct Delivery {
+        SimClient* client;
+        std::string message;
+
+        inline void operator()();
+    };
+
+    std::string port;
+    std::function<void(size_t, std::string)> callback;
+    std::vector<SimClient*> peers;
+    // both directions, indexed by connection id; a deque so links never move
+    std::deque<Simulator::Link> links, inbound;
+    Waiters<size_t> acceptors;
+    std::deque<Waiters<std::string>> receivers;
+    bool initialized = false, started = false, stopped = false;
+};
+
+template<size_t N>
+class SimServer : public SimServerBase {
+public:
+    using SimServerBase::SimServerBase;
+
+    SimServer() = default;
+    SimServer& operator=(SimServer&& server) {
+        SimServerBase::operator=(std::move(server));
+        return *this;
+    }
+};
+
+class SimClient {
+public:
+
+    SimClient() = default;
+    SimClient(std::function<void(std::string)> _callback, std::string _hostname, std::string _port, TransportProfile _profile = TransportProfile()) {
+        callback = _callback;
+        port = _port;
+        initialized = true;
+    }
+
+    SimClient& operator=(SimClient&& client) {
+        if (this->initialized)
+            throw std::runtime_error("Trying to initialized an initialized client");
+        if (!client.initialized)
+            throw std::runtime_error("Trying to initialize client with uninitialized client");
+        if (client.server != nullptr)
+            throw std::runtime_error("Trying to initialize client with running client");
+
+        port = client.port;
+        callback = std::move(client.callback);
+        initialized = true;
+        client.initialized = false;
+        return *this;
+    }
+
+    // connects at once, the simulated handshake takes no time
+    int start() {
+        if (!initialized)
+            throw std::runtime_error("Not initialized!");
+        server = Simulator::instance().lookup(port);
+        if (server == nullptr) {
+            std::cerr << "Cannot connect to server\n";
+            return -1;
+        }
+        connectionId = server->accept(this);
+        return 0;
+    }
+
+    // start() as the simulator's next event, see Client
+    Awaitable<int> connect() {
+        return Awaitable<int>([this](std::function<void(int)> onConnected) {
+            if (!initialized)
+                throw std::runtime_error("Not initialized!");
+            Simulator::instance().scheduleAt(Simulator::instance().now(), [this, onConnected]() {
+                onConnected(start());
+            });
+        });
+    }
+
+    Awaitable<std::string> receive() {
+        return Awaitable<std::string>([this](std::function<void(std::string)> onFrame) {
+            receivers.add(std::move(onFrame));
+        });
+    }
+
+    void shutdown() {
+        stopped = true;
+    }
+
+    // a simulated server never goes away
+    void setCloseCallback(std::function<void()>) {}
+
+    void message(std::string message, Lane lane = Lane::CONTROL) {
+        if (server == nullptr) {
+            std::cerr << "Error on write\n";
+            return;
+        }
+        Simulator& simulator = Simulator::instance();
+        size_t size = message.size();
+        simulator.transmit(server->inboundLink(connectionId), simulator.linkModel(server->getPort()), size, lane, Delivery{server, connectionId, std::move(message)});
+    }
+
+    void deliver(std::string message) {
+        if (!stopped && !receivers.offer(message)) callback(std::move(message));
+    }
+
+    uint64_t scheduleAt(SimClock::time_point when, std::function<void()> callback) {
+        return Simulator::instance().scheduleAt(when.time_since_epoch().count(), std::move(callback));
+    }
+
+    void cancel(uint64_t id) {
+        Simulator::instance().cancel(id);
+    }
+
+    const std::string& getPort() const {
+        return port;
+    }
+
+private:
+    // moves the message into the server's callback when the event runs
+    struct Delivery {
+        SimServerBase* server;
+        size_t connectionId;
+        std::string message;
+
+        void operator()() {
+            server->deliver(connectionId, std::move(message));
+        }
+    };
+
+    std::string port;
+    std::function<void(std::string)> callback;
+    SimServerBase* server = nullptr;
+    size_t connectionId = 0;
+    Waiters<std::string> receivers;
+    bool initialized = false, stopped = false;
+};
+
+void SimServerBase::Delivery::operator()() {
+    client->deliver(std::move(message));
+}
+
+void SimServerBase::message(size_t clientId, std::string message, Lane lane) {
+    if (clientId >= peers.size()) {
+        std::cerr << "Error on write\n";
+        return;
+    }
+    Simulator& simulator = Simulator::instance();
+    size_t size = message.size();
+    simulator.transmit(links[clientId], simulator.linkModel(port), size, lane, Delivery{peers[clientId], std::move(message)});
+}
+
+struct SimTransport {
+    template<size_t N>
+    using Server = SimServer<N>;
+    using Client = SimClient;
+    using Clock = SimClock;
+    static constexpr bool REAL_TIME = false;
+};
+
+#endif
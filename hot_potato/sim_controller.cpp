@@ -0,0 +1,69 @@
+#include "sim.h"
+#include "ringmaster.h"
+#include "player.h"
+#include <memory>
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 3 || argc % 2 != 1) {
+        std::cout << "Usage: ./simulate <num players> <num hops> [--latency-us <us>] [--jitter-us <us>] [--bandwidth-mbps <Mbit/s>] [--seed <seed>] [--trace ids|bits] [--trace-out <file>|-|none] [--trace-format text|csv|binary] [--trace-mmap yes|no] [--stats-out <file>|-] [--stats-visits summary|all] [--payload <bytes>] [--tree-fanout <children>] [--rate <potatoes/s> --count <potatoes>] [--routing random|load] [--segments <ringmasters>]\n";
+        return 1;
+    }
+
+    size_t numPlayers = std::stoi(argv[1]);
+    size_t numHops = std::stoi(argv[2]);
+
+    RingMasterOptions options;
+    std::map<std::string, std::string> flags = parseFlags(argc, argv, 3);
+    applyRingMasterFlags(options, flags);
+
+    LinkModel link;
+    if (flags.count("latency-us")) link.latencyNs = (uint64_t) (std::stod(flags["latency-us"]) * 1e3);
+    if (flags.count("jitter-us")) link.jitterNs = (uint64_t) (std::stod(flags["jitter-us"]) * 1e3);
+    if (flags.count("bandwidth-mbps")) link.bytesPerSecond = std::stod(flags["bandwidth-mbps"]) * 1e6 / 8;
+    uint64_t seed = flags.count("seed") ? std::stoull(flags["seed"]) : 1;
+
+    Simulator& simulator = Simulator::instance();
+    simulator.setDefaultLinkModel(link);
+    simulator.seed(seed);
+
+    std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+    options.seed = (unsigned int) seed;
+    // a federated ring, see federation.h: ringmaster i listens on port i + 1,
+    // the lead is started first so the others find it
+    size_t numSegments = flags.count("segments") ? std::stoull(flags["segments"]) : 1;
+    if (numSegments > 1) {
+        options.numSegments = numSegments;
+        options.federationHost = "sim";
+        options.federationPort = "federation";
+    }
+    std::vector<std::unique_ptr<BasicRingMaster<SimTransport>>> ringmasters;
+    for(size_t segment = 0; segment < numSegments; segment++) {
+        options.segment = segment;
+        ringmasters.emplace_back(new BasicRingMaster<SimTransport>(std::to_string(segment + 1), numPlayers, numHops, options));
+        ringmasters.back()->start();
+    }
+    BasicRingMaster<SimTransport>& rm = *ringmasters[0];
+
+    PlayerOptions playerOptions;
+    playerOptions.verbose = false;
+    std::vector<std::unique_ptr<BasicPlayer<SimTransport>>> players;
+    for(const std::pair<size_t, size_t>& range: splitRange(0, numPlayers, numSegments)) {
+        std::string ringmasterPort = std::to_string(segmentOf(range.first, numPlayers, numSegments) + 1);
+        for(size_t i = range.first; i < range.second; i++) {
+            players.emplace_back(new BasicPlayer<SimTransport>("sim", ringmasterPort, playerOptions));
+            players.back()->start();
+        }
+    }
+
+    if (!simulator.runUntil([&rm]() { return rm.isDone(); })) {
+        std::cerr << "Simulation ran out of events before the game finished\n";
+        return 1;
+    }
+    simulator.run();
+
+    std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+    std::cout << "Simulated " << simulator.now() / 1e6 << " ms in " << simulator.numEventsRun()
+              << " events, " << wallTime.count() << " s wall time\n";
+}
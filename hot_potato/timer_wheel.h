@@ -0,0 +1,259 @@
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+#include "common_defs.h"
+#include <chrono>
+
+/*
+Hierarchical timing wheel:
+
+Time is counted in ticks. LEVELS wheels of SLOTS slots each cover
+SLOTS^LEVELS ticks; a timer goes into the lowest wheel whose current
+rotation contains its tick. When the lowest wheel wraps, the next slot of
+the wheel above is cascaded down, so every timer is moved at most LEVELS
+times. Timers further out than the top wheel reaches wait in its last slot
+and are placed again when it comes round.
+
+Timers live in a pool and are linked into their slot by index, so schedule
+and cancel are O(1) and hundreds of thousands of pending timers cost one
+node each.
+*/
+
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+
+    // ids are never 0, so 0 can stand for no timer
+    using TimerId = uint64_t;
+
+    TimerWheel(uint64_t _tickNs, uint64_t nowNs) {
+        tickNs = _tickNs;
+        currentTick = nowNs / tickNs;
+        for(size_t level = 0; level < LEVELS; level++)
+            for(size_t slot = 0; slot < SLOTS; slot++)
+                heads[level][slot] = NONE;
+        memset(occupied, 0, sizeof(occupied));
+    }
+
+    // runs no earlier than deadlineNs, and no later than the first advance a tick after it
+    TimerId schedule(uint64_t deadlineNs, Callback callback) {
+        uint32_t index;
+        if (freeNodes.empty()) {
+            index = nodes.size();
+            nodes.emplace_back();
+        } else {
+            index = freeNodes.back();
+            freeNodes.pop_back();
+        }
+
+        Node& node = nodes[index];
+        node.tick = std::max((deadlineNs + tickNs - 1) / tickNs, currentTick + 1);
+        node.callback = std::move(callback);
+        node.active = true;
+        insert(index);
+        numPending++;
+        return ((TimerId) node.generation << 32) | (index + 1);
+    }
+
+    // returns whether the timer was still pending
+    bool cancel(TimerId id) {
+        if (id == 0) return false;
+        uint32_t index = (uint32_t) (id & 0xffffffff) - 1;
+        if (index >= nodes.size()) return false;
+        Node& node = nodes[index];
+        if (!node.active || node.generation != (uint32_t) (id >> 32)) return false;
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    // moves time on to nowNs, appending the callbacks of every timer that is due to expired
+    void advance(uint64_t nowNs, std::vector<Callback>& expired) {
+        uint64_t targetTick = nowNs / tickNs;
+        while (currentTick < targetTick) {
+            if (numPending == 0) {
+                currentTick = targetTick;
+                break;
+            }
+            // nothing left in this rotation of the lowest wheel, skip to its end
+            if (isLowestEmpty()) {
+                uint64_t rotationEnd = currentTick | (SLOTS - 1);
+                if (rotationEnd >= targetTick) {
+                    currentTick = targetTick;
+                    break;
+                }
+                currentTick = rotationEnd;
+            }
+
+            currentTick++;
+            if ((currentTick & (SLOTS - 1)) == 0) cascade(1);
+
+            size_t slot = currentTick & (SLOTS - 1);
+            while (heads[0][slot] != NONE) {
+                uint32_t index = heads[0][slot];
+                unlink(index);
+                expired.push_back(std::move(nodes[index].callback));
+                release(index);
+            }
+        }
+    }
+
+    // the earliest time a timer may be due, or UINT64_MAX with none pending
+    uint64_t nextDeadlineNs() const {
+        if (numPending == 0) return UINT64_MAX;
+        size_t current = currentTick & (SLOTS - 1);
+        for(size_t slot = current + 1; slot < SLOTS; slot++)
+            if (occupied[slot / 64] & ((uint64_t) 1 << (slot % 64)))
+                return ((currentTick & ~(uint64_t) (SLOTS - 1)) + slot) * tickNs;
+        // the next cascade may bring timers down
+        return ((currentTick | (SLOTS - 1)) + 1) * tickNs;
+    }
+
+    size_t size() const {
+        return numPending;
+    }
+
+private:
+    constexpr static size_t LEVELS = 4;
+    constexpr static size_t SLOT_BITS = 8;
+    constexpr static size_t SLOTS = 1 << SLOT_BITS;
+    constexpr static uint32_t NONE = UINT32_MAX;
+
+    struct Node {
+        uint64_t tick = 0;
+        uint32_t generation = 0;
+        uint32_t prev = NONE, next = NONE;
+        uint8_t level = 0;
+        uint8_t slot = 0;
+        bool active = false;
+        Callback callback;
+    };
+
+    void insert(uint32_t index) {
+        Node& node = nodes[index];
+        size_t level = 0;
+        while (level < LEVELS - 1 && (node.tick >> (SLOT_BITS * (level + 1))) != (currentTick >> (SLOT_BITS * (level + 1))))
+            level++;
+
+        size_t slot;
+        if (level == LEVELS - 1 && (node.tick >> (SLOT_BITS * LEVELS)) != (currentTick >> (SLOT_BITS * LEVELS)))
+            // past the top wheel, park it in the slot that comes round last
+            slot = ((currentTick >> (SLOT_BITS * level)) - 1) & (SLOTS - 1);
+        else
+            slot = (node.tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+        node.level = level;
+        node.slot = slot;
+        node.prev = NONE;
+        node.next = heads[level][slot];
+        if (node.next != NONE) nodes[node.next].prev = index;
+        heads[level][slot] = index;
+        if (level == 0) occupied[slot / 64] |= (uint64_t) 1 << (slot % 64);
+    }
+
+    void unlink(uint32_t index) {
+        Node& node = nodes[index];
+        if (node.prev != NONE) nodes[node.prev].next = node.next;
+        else heads[node.level][node.slot] = node.next;
+        if (node.next != NONE) nodes[node.next].prev = node.prev;
+        if (node.level == 0 && heads[0][node.slot] == NONE)
+            occupied[node.slot / 64] &= ~((uint64_t) 1 << (node.slot % 64));
+    }
+
+    void release(uint32_t index) {
+        Node& node = nodes[index];
+        node.active = false;
+        node.generation++;
+        node.callback = nullptr;
+        freeNodes.push_back(index);
+        numPending--;
+    }
+
+    // the wheels below level just wrapped, bring level's current slot down
+    void cascade(size_t level) {
+        if (level >= LEVELS) return;
+        size_t slot = (currentTick >> (SLOT_BITS * level)) & (SLOTS - 1);
+        if (slot == 0) cascade(level + 1);
+
+        uint32_t index = heads[level][slot];
+        heads[level][slot] = NONE;
+        while (index != NONE) {
+            uint32_t next = nodes[index].next;
+            insert(index);
+            index = next;
+        }
+    }
+
+    bool isLowestEmpty() const {
+        for(size_t i = 0; i < SLOTS / 64; i++)
+            if (occupied[i] != 0) return false;
+        return true;
+    }
+
+    uint64_t tickNs, currentTick;
+    uint32_t heads[LEVELS][SLOTS];
+    uint64_t occupied[SLOTS / 64];
+    std::vector<Node> nodes;
+    std::vector<uint32_t> freeNodes;
+    size_t numPending = 0;
+};
+
+// Timers of one Server or Client event loop. Any thread may schedule or
+// cancel; callbacks run on the loop's thread, outside the lock.
+class LoopTimers {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    LoopTimers() : wheel(TICK_NS, nowNs()) {}
+
+    TimerWheel::TimerId scheduleAt(Clock::time_point when, TimerWheel::Callback callback) {
+        uint64_t deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+        std::unique_lock<std::mutex> lock(timerLock);
+        return wheel.schedule(deadline, std::move(callback));
+    }
+
+    bool cancel(TimerWheel::TimerId id) {
+        std::unique_lock<std::mutex> lock(timerLock);
+        return wheel.cancel(id);
+    }
+
+    // how long the loop may wait for IO before the next timer, at most maxWait
+    struct timeval timeout(std::chrono::microseconds maxWait) {
+        uint64_t waitNs = maxWait.count() * 1000;
+        {
+            std::unique_lock<std::mutex> lock(timerLock);
+            uint64_t deadline = wheel.nextDeadlineNs();
+            uint64_t now = nowNs();
+            if (deadline != UINT64_MAX)
+                waitNs = std::min(waitNs, deadline > now ? deadline - now : 0);
+        }
+        struct timeval tv;
+        tv.tv_sec = waitNs / 1000000000;
+        tv.tv_usec = (waitNs % 1000000000) / 1000;
+        return tv;
+    }
+
+    // runs every timer that is due
+    void run() {
+        {
+            std::unique_lock<std::mutex> lock(timerLock);
+            wheel.advance(nowNs(), expired);
+        }
+        for(TimerWheel::Callback& callback: expired) callback();
+        expired.clear();
+    }
+
+private:
+    static uint64_t nowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    // fine enough for select's microsecond timeout
+    constexpr static uint64_t TICK_NS = 10000;
+
+    std::mutex timerLock;
+    TimerWheel wheel;
+    std::vector<TimerWheel::Callback> expired;
+};
+
+#endif
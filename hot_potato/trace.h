@@ -0,0 +1,141 @@
+#ifndef TRACE
+#define TRACE
+
+#include "common_defs.h"
+#include <string>
+#include <sstream>
+
+/*
+Trace modes:
+
+IDS:
+    every holder appends its own id to the potato, the trace is the
+    comma separated id list
+
+DIRECTION_BITS:
+    the potato carries the first holder plus one neighbour index per hop,
+    packed bitsPerHop bits at a time (1 bit on a ring: 0 = next, 1 = prev).
+    The packed stream is stored 6 bits per character so it stays safe for
+    the text protocol, and a holder can append a hop by touching only the
+    last character.
+*/
+
+enum class TraceMode {
+    IDS = 0,
+    DIRECTION_BITS = 1,
+};
+
+TraceMode parseTraceMode(const std::string& str) {
+    if (str == "ids") return TraceMode::IDS;
+    if (str == "bits") return TraceMode::DIRECTION_BITS;
+    throw std::runtime_error("Unknown trace mode " + str);
+}
+
+std::string traceModeName(TraceMode mode) {
+    return mode == TraceMode::DIRECTION_BITS ? "bits" : "ids";
+}
+
+// bits needed to tell apart degree neighbours, at least 1
+size_t bitsForDegree(size_t degree) {
+    size_t bits = 1;
+    while (((size_t) 1 << bits) < degree) bits++;
+    return bits;
+}
+
+// neighbour index 0 is next, 1 is prev
+size_t ringNeighbour(size_t id, size_t neighbourIdx, size_t numPlayers) {
+    if (neighbourIdx == 0) return (id + 1) % numPlayers;
+    return (id + numPlayers - 1) % numPlayers;
+}
+
+struct DirectionTrace {
+    constexpr static size_t BITS_PER_CHAR = 6;
+    constexpr static size_t NUM_SYMBOLS_WIDTH = 20;
+
+    size_t startId = 0;
+    size_t bitsPerHop = 1;
+    size_t numSymbols = 0;
+    std::string packed;
+
+    void append(size_t neighbourIdx) {
+        appendSymbol(packed, numSymbols, bitsPerHop, neighbourIdx);
+        numSymbols++;
+    }
+
+    // appends one symbol to a packed stream that ends str and already holds numSymbols symbols
+    static void appendSymbol(std::string& str, size_t numSymbols, size_t bitsPerHop, size_t neighbourIdx) {
+        for(size_t b = 0; b < bitsPerHop; b++) {
+            size_t bitPos = numSymbols * bitsPerHop + b;
+            if (bitPos % BITS_PER_CHAR == 0)
+                str.push_back(encodeChar(0));
+
+            if ((neighbourIdx >> (bitsPerHop - 1 - b)) & 1) {
+                char& last = str.back();
+                last = encodeChar(decodeChar(last) | (1 << (BITS_PER_CHAR - 1 - bitPos % BITS_PER_CHAR)));
+            }
+        }
+    }
+
+    size_t at(size_t symbol) const {
+        size_t value = 0;
+        for(size_t b = 0; b < bitsPerHop; b++) {
+            size_t bitPos = symbol * bitsPerHop + b;
+            size_t bit = (decodeChar(packed[bitPos / BITS_PER_CHAR]) >> (BITS_PER_CHAR - 1 - bitPos % BITS_PER_CHAR)) & 1;
+            value = (value << 1) | bit;
+        }
+        return value;
+    }
+
+    // walks the full id list, resolve(id, neighbourIdx) gives the next holder
+    template<typename Resolve, typename Visit>
+    void expand(Resolve resolve, Visit visit) const {
+        size_t curId = startId;
+        visit(curId);
+        for(size_t i = 0; i < numSymbols; i++) {
+            curId = resolve(curId, at(i));
+            visit(curId);
+        }
+    }
+
+    // start,bitsPerHop,numSymbols,packed
+    // numSymbols is zero padded to NUM_SYMBOLS_WIDTH so it can be patched in place
+    std::string serialize() const {
+        std::ostringstream oss;
+        oss << startId << ',' << bitsPerHop << ',' << fixedWidth(numSymbols, NUM_SYMBOLS_WIDTH) << ',' << packed;
+        return oss.str();
+    }
+
+    static DirectionTrace deserialize(const std::string& str) {
+        DirectionTrace trace;
+        std::istringstream iss(str);
+        std::string token;
+
+        std::getline(iss, token, ',');
+        trace.startId = std::stoull(token);
+        std::getline(iss, token, ',');
+        trace.bitsPerHop = std::stoull(token);
+        std::getline(iss, token, ',');
+        trace.numSymbols = std::stoull(token);
+        std::getline(iss, trace.packed);
+
+        if (trace.packed.size() * BITS_PER_CHAR < trace.numSymbols * trace.bitsPerHop)
+            throw std::runtime_error("Direction trace shorter than its symbol count");
+
+        return trace;
+    }
+
+    static char encodeChar(int value) {
+        return "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[value];
+    }
+
+    static int decodeChar(char c) {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '+') return 62;
+        if (c == '/') return 63;
+        throw std::runtime_error("Invalid character in direction trace");
+    }
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef TRACE_OUTPUT
+#define TRACE_OUTPUT
+
+#include "common_defs.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Buffered writer over a file descriptor, or over a growing memory mapping of a file.
+class TraceOutput {
+public:
+
+    TraceOutput() = default;
+
+    ~TraceOutput() {
+        close();
+    }
+
+    int open(const std::string& path, bool useMmap) {
+        if (path == "-") {
+            if (useMmap)
+                throw std::runtime_error("Cannot memory map stdout");
+            fd = STDOUT_FILENO;
+            ownsFd = false;
+        } else {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                std::cerr << "Error: cannot open trace output " << path << ": " << strerror(errno) << '\n';
+                return -1;
+            }
+            ownsFd = true;
+        }
+        mapped = useMmap;
+        if (!mapped) buffer.reserve(BUFFER_CAPACITY);
+        return 0;
+    }
+
+    void write(const char* data, size_t len) {
+        if (mapped) {
+            while (len > 0) {
+                if (mapOffset == mapSize) remap();
+                size_t amount = std::min(len, mapSize - mapOffset);
+                memcpy(mapBase + mapOffset, data, amount);
+                mapOffset += amount;
+                data += amount;
+                len -= amount;
+            }
+        } else {
+            if (buffer.size() + len > BUFFER_CAPACITY) flush();
+            if (len > BUFFER_CAPACITY) writeAll(data, len);
+            else buffer.append(data, len);
+        }
+    }
+
+    void put(char c) {
+        write(&c, 1);
+    }
+
+    void putNumber(size_t value) {
+        char digits[20];
+        size_t len = 0;
+        do {
+            digits[len++] = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        for(size_t i = 0; i < len / 2; i++) std::swap(digits[i], digits[len - 1 - i]);
+        write(digits, len);
+    }
+
+    void flush() {
+        if (!buffer.empty()) {
+            writeAll(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    void close() {
+        if (fd < 0) return;
+        if (mapped) {
+            size_t written = mapFileOffset + mapOffset;
+            if (mapBase != nullptr) munmap(mapBase, mapSize);
+            mapBase = nullptr;
+            if (ftruncate(fd, written) != 0)
+                std::cerr << "Error truncating trace output\n";
+        } else {
+            flush();
+        }
+        if (ownsFd) ::close(fd);
+        fd = -1;
+    }
+
+private:
+    void writeAll(const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t status = ::write(fd, data, len);
+            if (status < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "Error on trace write\n";
+                return;
+            }
+            data += status;
+            len -= status;
+        }
+    }
+
+    // move the mapping window to the end of what was written so far, growing the file
+    void remap() {
+        if (mapBase != nullptr) {
+            munmap(mapBase, mapSize);
+            mapFileOffset += mapSize;
+        }
+        mapSize = MAP_WINDOW;
+        mapOffset = 0;
+        if (ftruncate(fd, mapFileOffset + mapSize) != 0)
+            throw std::runtime_error("Cannot grow trace output: " + std::string(strerror(errno)));
+        void* base = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mapFileOffset);
+        if (base == MAP_FAILED)
+            throw std::runtime_error("Cannot map trace output: " + std::string(strerror(errno)));
+        mapBase = (char*) base;
+    }
+
+    constexpr static size_t BUFFER_CAPACITY = 1 << 20;
+    constexpr static size_t MAP_WINDOW = 1 << 24;
+
+    int fd = -1;
+    bool ownsFd = false, mapped = false;
+    std::string buffer;
+
+    char* mapBase = nullptr;
+    size_t mapSize = 0, mapOffset = 0, mapFileOffset = 0;
+};
+
+#endif
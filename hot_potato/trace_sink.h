@@ -0,0 +1,214 @@
+#ifndef TRACE_SINK
+#define TRACE_SINK
+
+#include "commands.h"
+#include "trace_stats.h"
+#include "trace_output.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/*
+Trace output formats:
+
+TEXT:
+    Trace of potato:
+    id,id,...,id
+
+CSV:
+    hop,player
+    0,id
+    ...
+
+BINARY:
+    uint64 number of holders, then one uint64 id per holder, host byte order
+*/
+
+enum class TraceFormat {
+    TEXT = 0,
+    CSV = 1,
+    BINARY = 2,
+};
+
+TraceFormat parseTraceFormat(const std::string& str) {
+    if (str == "text") return TraceFormat::TEXT;
+    if (str == "csv") return TraceFormat::CSV;
+    if (str == "binary") return TraceFormat::BINARY;
+    throw std::runtime_error("Unknown trace format " + str);
+}
+
+// "yes" to true, "no" to false, see TraceSinkOptions::mmap
+bool parseTraceMmap(const std::string& str) {
+    if (str == "yes") return true;
+    if (str == "no") return false;
+    throw std::runtime_error("Unknown trace mmap " + str);
+}
+
+// "all" to true, "summary" to false, see TraceSinkOptions::listVisits
+bool parseStatsVisits(const std::string& str) {
+    if (str == "all") return true;
+    if (str == "summary") return false;
+    throw std::runtime_error("Unknown stats visits " + str);
+}
+
+// a path of "none" skips the output
+struct TraceSinkOptions {
+    std::string path = "-";
+    TraceFormat format = TraceFormat::TEXT;
+    bool mmap = false;
+    std::string statsPath = "none";
+    // the stats list every player's visits, not only their spread
+    bool listVisits = false;
+};
+
+// Streams finished traces to the output on its own thread, so the handler
+// that receives the potato never waits on the expansion or the writes.
+class TraceSink {
+public:
+
+    TraceSink() = default;
+
+    ~TraceSink() {
+        close();
+    }
+
+    int start(TraceSinkOptions _options, size_t _numPlayers) {
+        options = _options;
+        numPlayers = _numPlayers;
+        if (options.path != "none" && output.open(options.path, options.mmap) != 0)
+            return -1;
+        if (options.statsPath != "none" && statsOutput.open(options.statsPath, false) != 0)
+            return -1;
+        stop = false;
+        writerThread = std::thread(std::bind(&TraceSink::main, this));
+        return 0;
+    }
+
+    // elapsed is the time from the potato leaving the ringmaster to it coming
+    // back, ringSize is as in TraceStats
+    void submit(Potato potato, std::chrono::nanoseconds elapsed, size_t payloadSize, size_t ringSize) {
+        // anything already printed through std::cout comes before the trace
+        std::cout.flush();
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            pending.push_back(Game{std::move(potato), elapsed, payloadSize, ringSize});
+        }
+        queueReady.notify_one();
+    }
+
+    // drains every submitted trace, then stops the writer
+    void close() {
+        if (!writerThread.joinable()) return;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            stop = true;
+        }
+        queueReady.notify_one();
+        writerThread.join();
+        output.close();
+        statsOutput.close();
+    }
+
+private:
+    struct Game {
+        Potato potato;
+        std::chrono::nanoseconds elapsed;
+        size_t payloadSize;
+        size_t ringSize;
+    };
+
+    void main() {
+        while (true) {
+            Game game;
+            {
+                std::unique_lock<std::mutex> lock(queueLock);
+                queueReady.wait(lock, [this]() { return stop || !pending.empty(); });
+                if (pending.empty()) break;
+                game = std::move(pending.front());
+                pending.pop_front();
+            }
+
+            bool withStats = options.statsPath != "none";
+            if (withStats) stats.begin(numPlayers, game.ringSize);
+
+            if (options.path != "none") {
+                writeTrace(game.potato, withStats);
+                output.flush();
+            } else if (withStats) {
+                game.potato.forEachHolder(resolver(true), [this](size_t id) { stats.visit(id); });
+            }
+
+            if (withStats) {
+                stats.report(statsOutput, game.elapsed, game.payloadSize, options.listVisits);
+                statsOutput.flush();
+            }
+        }
+    }
+
+    // with stats, also tells them the direction of every hop it resolves
+    std::function<size_t(size_t, size_t)> resolver(bool withStats) {
+        size_t numPlayers = this->numPlayers;
+        TraceStats* hopStats = withStats ? &stats : nullptr;
+        return [numPlayers, hopStats](size_t id, size_t neighbourIdx) {
+            if (hopStats) hopStats->passTo(neighbourIdx);
+            return ringNeighbour(id, neighbourIdx, numPlayers);
+        };
+    }
+
+    // writes the trace, feeding the stats in the same pass
+    void writeTrace(const Potato& potato, bool withStats) {
+        auto resolve = resolver(withStats);
+
+        switch(options.format) {
+            case TraceFormat::TEXT: {
+                const char header[] = "Trace of potato:\n";
+                output.write(header, sizeof(header) - 1);
+                bool first = true;
+                potato.forEachHolder(resolve, [this, &first, withStats](size_t id) {
+                    if (withStats) stats.visit(id);
+                    if (!first) output.put(VECTOR_DELIM);
+                    first = false;
+                    output.putNumber(id);
+                });
+                output.put('\n');
+                break;
+            }
+            case TraceFormat::CSV: {
+                const char header[] = "hop,player\n";
+                output.write(header, sizeof(header) - 1);
+                size_t hop = 0;
+                potato.forEachHolder(resolve, [this, &hop, withStats](size_t id) {
+                    if (withStats) stats.visit(id);
+                    output.putNumber(hop++);
+                    output.put(',');
+                    output.putNumber(id);
+                    output.put('\n');
+                });
+                break;
+            }
+            case TraceFormat::BINARY: {
+                uint64_t count = potato.numHolders();
+                output.write((const char*) &count, sizeof(count));
+                potato.forEachHolder(resolve, [this, withStats](size_t id) {
+                    if (withStats) stats.visit(id);
+                    uint64_t value = id;
+                    output.write((const char*) &value, sizeof(value));
+                });
+                break;
+            }
+        }
+    }
+
+    TraceSinkOptions options;
+    size_t numPlayers = 0;
+    TraceOutput output, statsOutput;
+    TraceStats stats;
+
+    std::deque<Game> pending;
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    bool stop = false;
+    std::thread writerThread;
+};
+
+#endif
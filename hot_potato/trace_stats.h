@@ -0,0 +1,162 @@
+#ifndef TRACE_STATS
+#define TRACE_STATS
+
+#include "common_defs.h"
+#include <chrono>
+#include <sstream>
+#include <cmath>
+
+/*
+Game summary, computed in one pass over the holders with O(numPlayers) memory:
+
+    visits:       how many players held the potato, and the fewest, most,
+                  mean and standard deviation of times one of them held
+                  it; with listVisits also each player's count
+    hop distance: signed ring distance between consecutive holders
+                  (+1 = passed to next, -1 = passed to prev); a direction
+                  trace tells which neighbour was chosen, an ids trace of
+                  two players cannot as next and prev are the same. The
+                  ring is players 0 to ringSize - 1 in id order, a game
+                  whose ring changed on the way (ringSize 0) has none
+    longest run:  most consecutive hops in the same direction
+    time:         from the potato leaving the ringmaster to it coming back
+    payload:      payload size and the bandwidth it moved at, counting every
+                  link it crossed including to and from the ringmaster
+*/
+
+class TraceStats {
+public:
+
+    void begin(size_t _numPlayers, size_t _ringSize) {
+        numPlayers = _numPlayers;
+        ringSize = _ringSize;
+        visits.assign(numPlayers, 0);
+        distances.clear();
+        numHolders = 0;
+        curRun = longestRun = 0;
+        curDirection = longestDirection = 0;
+        passedTo = 0;
+        directionsUnknown = ringSize == 0 ? "the ring changed during the game" : nullptr;
+    }
+
+    // the holder about to be visited was its predecessor's neighbourIdx-th
+    // neighbour, see ringNeighbour
+    void passTo(size_t neighbourIdx) {
+        passedTo = neighbourIdx == 0 ? 1 : -1;
+    }
+
+    void visit(size_t id) {
+        if (id >= numPlayers)
+            throw std::runtime_error("Trace holder " + std::to_string(id) + " is not a player");
+
+        visits[id]++;
+        if (numHolders > 0 && !directionsUnknown) {
+            long long distance = passedTo;
+            if (passedTo == 0) {
+                if (ringSize <= 2) directionsUnknown = "next and prev are the same player";
+                distance = signedDistance(lastId, id);
+            }
+            passedTo = 0;
+            distances[distance]++;
+
+            int direction = (distance > 0) - (distance < 0);
+            if (direction != 0 && direction == curDirection) {
+                curRun++;
+            } else {
+                curDirection = direction;
+                curRun = direction != 0 ? 1 : 0;
+            }
+            if (curRun > longestRun) {
+                longestRun = curRun;
+                longestDirection = curDirection;
+            }
+        }
+        lastId = id;
+        numHolders++;
+    }
+
+    template<typename Output>
+    void report(Output& output, std::chrono::nanoseconds elapsed, size_t payloadSize, bool listVisits) const {
+        std::ostringstream oss;
+        oss << "Game summary:\n";
+        oss << "hops: " << numHolders << ", players: " << numPlayers
+            << ", time: " << std::chrono::duration<double, std::milli>(elapsed).count() << " ms\n";
+
+        reportVisits(oss);
+        if (listVisits) {
+            oss << "\nvisits per player: ";
+            for(size_t id = 0; id < numPlayers; id++) {
+                if (id > 0) oss << ',';
+                oss << id << ':' << visits[id];
+            }
+        }
+
+        if (!directionsUnknown) {
+            oss << "\nhop distance: ";
+            bool first = true;
+            for(auto& entry: distances) {
+                if (!first) oss << ',';
+                first = false;
+                oss << std::showpos << entry.first << std::noshowpos << ':' << entry.second;
+            }
+
+            oss << "\nlongest run: " << longestRun;
+            if (longestRun > 0) oss << (longestDirection > 0 ? " (next)" : " (prev)");
+            oss << '\n';
+        } else {
+            oss << "\nhop distance: unknown, " << directionsUnknown;
+            oss << "\nlongest run: unknown\n";
+        }
+
+        if (payloadSize > 0) {
+            double seconds = std::chrono::duration<double>(elapsed).count();
+            double bytesMoved = (double) payloadSize * (numHolders + 1);
+            oss << "payload: " << payloadSize << " bytes, " << (seconds > 0 ? bytesMoved / seconds / 1e6 : 0) << " MB/s\n";
+        }
+
+        std::string str = oss.str();
+        output.write(str.data(), str.size());
+    }
+
+private:
+    // over the players that held the potato, in an elastic game the other
+    // ids may never have been in the ring
+    void reportVisits(std::ostringstream& oss) const {
+        size_t numHeld = 0, fewest = 0, most = 0;
+        double sum = 0, sumSquares = 0;
+        for(size_t id = 0; id < numPlayers; id++) {
+            if (visits[id] == 0) continue;
+            if (numHeld == 0 || visits[id] < visits[fewest]) fewest = id;
+            if (numHeld == 0 || visits[id] > visits[most]) most = id;
+            numHeld++;
+            sum += visits[id];
+            sumSquares += (double) visits[id] * visits[id];
+        }
+
+        oss << "visits: held by " << numHeld << " of " << numPlayers << " players";
+        if (numHeld == 0) return;
+        double mean = sum / numHeld;
+        oss << ", min " << visits[fewest] << " (player " << fewest << ")"
+            << ", max " << visits[most] << " (player " << most << ")"
+            << ", mean " << mean << ", stddev " << std::sqrt(std::max(sumSquares / numHeld - mean * mean, 0.0));
+    }
+
+    // shortest way around the ring from one holder to the other
+    long long signedDistance(size_t from, size_t to) const {
+        size_t forward = (to + ringSize - from) % ringSize;
+        if (forward * 2 <= ringSize) return (long long) forward;
+        return (long long) forward - (long long) ringSize;
+    }
+
+    size_t numPlayers = 0, ringSize = 0, numHolders = 0, lastId = 0;
+    std::vector<size_t> visits;
+    std::map<long long, size_t> distances;
+    size_t curRun = 0, longestRun = 0;
+    int curDirection = 0, longestDirection = 0;
+    // +1 or -1 when the coming hop's direction is known, see passTo
+    int passedTo = 0;
+    // why hop distance and longest run are not reported, null if they are
+    const char* directionsUnknown = nullptr;
+};
+
+#endif
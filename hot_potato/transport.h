@@ -0,0 +1,18 @@
+#ifndef TRANSPORT
+#define TRANSPORT
+
+#include "server.h"
+#include "client.h"
+#include <chrono>
+
+// What Player and RingMaster run on. SocketTransport is the real network,
+// SimTransport (sim.h) runs the same state machines in the simulator.
+struct SocketTransport {
+    template<size_t N>
+    using Server = ::Server<N>;
+    using Client = ::Client;
+    using Clock = std::chrono::steady_clock;
+    static constexpr bool REAL_TIME = true;
+};
+
+#endif
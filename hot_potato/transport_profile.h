@@ -0,0 +1,151 @@
+#ifndef TRANSPORT_PROFILE
+#define TRANSPORT_PROFILE
+
+#include "common_defs.h"
+#include <netinet/tcp.h>
+
+/*
+Transport profiles, applied to every socket a Server or Client creates:
+
+default:
+    system defaults, Nagle's algorithm on
+
+latency:
+    TCP_NODELAY so small hop messages go out at once, TCP_QUICKACK re-armed
+    after every read so the peer is not held up by delayed ACKs, and
+    SO_BUSY_POLL so reads spin on the device queue for a while
+
+throughput:
+    Nagle's algorithm left on to coalesce small writes, large socket
+    buffers for big payloads
+
+Any profile can batch potatoes on top (--batch-delay-us, --batch-size): the
+potatoes sent to one peer go out together as one frame and one write, once
+batchSize of them are waiting or the first has waited batchDelayUs. More
+potatoes per write for up to batchDelayUs more latency per hop.
+
+Or spin (--spin-us): event loops poll instead of sleeping while traffic
+keeps coming, see busy_poll.h. Fewer wakeups for a busy core.
+
+Every profile gives a client connectTimeoutMs to reach its server
+(--connect-timeout-ms), trying again every connectRetryMs, and closes a
+connection nothing was read from for idleTimeoutMs (--idle-timeout-ms, off
+by default since a ring may rightly wait long for the potato). Both are
+deadlines on the loop's timers, see timer_wheel.h.
+*/
+
+struct TransportProfile {
+    std::string name = "default";
+    bool noDelay = false;
+    bool quickAck = false;
+    // 0 keeps the system default
+    int sendBuffer = 0;
+    int receiveBuffer = 0;
+    int busyPollUs = 0;
+    // 0 means the number of connections the server accepts
+    int listenBacklog = 0;
+    // 0 sends every potato on its own
+    int batchDelayUs = 0;
+    int batchSize = 16;
+    // 0 sleeps in select whenever there is nothing to read
+    int spinUs = 0;
+    int connectTimeoutMs = 10000;
+    int connectRetryMs = 1000;
+    // 0 never closes an idle connection
+    int idleTimeoutMs = 0;
+};
+
+TransportProfile getTransportProfile(const std::string& name) {
+    TransportProfile profile;
+    profile.name = name;
+
+    if (name == "default") {
+        return profile;
+    } else if (name == "latency") {
+        profile.noDelay = true;
+        profile.quickAck = true;
+        profile.busyPollUs = 50;
+        profile.listenBacklog = SOMAXCONN;
+    } else if (name == "throughput") {
+        profile.sendBuffer = 4 << 20;
+        profile.receiveBuffer = 4 << 20;
+        profile.listenBacklog = SOMAXCONN;
+    } else {
+        throw std::runtime_error("Unknown transport profile " + name);
+    }
+    return profile;
+}
+
+// --profile and the flags that apply on top of it
+void applyProfileFlags(TransportProfile& profile, std::map<std::string, std::string>& flags) {
+    if (flags.count("profile")) profile = getTransportProfile(flags["profile"]);
+    if (flags.count("batch-delay-us")) profile.batchDelayUs = std::stoi(flags["batch-delay-us"]);
+    if (flags.count("batch-size")) profile.batchSize = std::stoi(flags["batch-size"]);
+    if (flags.count("spin-us")) profile.spinUs = std::stoi(flags["spin-us"]);
+    if (flags.count("connect-timeout-ms")) profile.connectTimeoutMs = std::stoi(flags["connect-timeout-ms"]);
+    if (flags.count("idle-timeout-ms")) profile.idleTimeoutMs = std::stoi(flags["idle-timeout-ms"]);
+    if (profile.batchDelayUs < 0 || profile.spinUs < 0 || profile.idleTimeoutMs < 0)
+        throw std::runtime_error("Batch delay, spin budget and idle timeout cannot be negative");
+    if (profile.connectTimeoutMs < 1)
+        throw std::runtime_error("Connect timeout must be at least 1 ms");
+    if (profile.batchSize < 1)
+        throw std::runtime_error("Batch size must be at least 1");
+}
+
+// potatoes to a batch, 0 if batching is off
+size_t batchRecords(const TransportProfile& profile) {
+    return profile.batchDelayUs > 0 ? profile.batchSize : 0;
+}
+
+// the best effort socket options, each a bit of the warned mask below
+enum class ProfileOption {
+    QUICK_ACK,
+    SEND_BUFFER,
+    RECEIVE_BUFFER,
+    BUSY_POLL
+};
+
+const char* profileOptionName(ProfileOption option) {
+    switch(option) {
+        case ProfileOption::QUICK_ACK: return "TCP_QUICKACK";
+        case ProfileOption::SEND_BUFFER: return "SO_SNDBUF";
+        case ProfileOption::RECEIVE_BUFFER: return "SO_RCVBUF";
+        case ProfileOption::BUSY_POLL: return "SO_BUSY_POLL";
+    }
+    return "unknown option";
+}
+
+// best effort options only warn, once per option and process
+void warnProfileOption(ProfileOption option) {
+    static std::atomic<unsigned> warned(0);
+    unsigned bit = 1u << (unsigned) option;
+    if (!(warned.fetch_or(bit) & bit))
+        std::cerr << "Warning: could not set " << profileOptionName(option) << ": " << strerror(errno) << '\n';
+}
+
+// applies the profile to a socket before it is bound, listened on or connected
+status_t applySocketProfile(socketfd_t fd, const TransportProfile& profile) {
+    int yes = 1;
+    if (profile.noDelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != 0) {
+        std::cerr << "Error on setting TCP_NODELAY\n";
+        return -1;
+    }
+    if (profile.quickAck && setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes)) != 0)
+        warnProfileOption(ProfileOption::QUICK_ACK);
+    if (profile.sendBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile.sendBuffer, sizeof(int)) != 0)
+        warnProfileOption(ProfileOption::SEND_BUFFER);
+    if (profile.receiveBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &profile.receiveBuffer, sizeof(int)) != 0)
+        warnProfileOption(ProfileOption::RECEIVE_BUFFER);
+    if (profile.busyPollUs > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &profile.busyPollUs, sizeof(int)) != 0)
+        warnProfileOption(ProfileOption::BUSY_POLL);
+    return 0;
+}
+
+// TCP_QUICKACK is not sticky, the kernel may fall back to delayed ACKs after a read
+void rearmAfterRead(socketfd_t fd, const TransportProfile& profile) {
+    if (!profile.quickAck) return;
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes));
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef WIRE_LOG
+#define WIRE_LOG
+
+#include "common_defs.h"
+#include "trace_output.h"
+#include <chrono>
+
+/*
+Wire log format, host byte order:
+
+    "HPWIRE01"
+    uint32 length, role ("ringmaster" or "player")
+    uint32 number of arguments, then per argument uint32 length, bytes
+    records until the end of the file:
+        WireRecordHeader, then length bytes of frame body
+
+Endpoints are numbered in the order their Server or Client is started, which
+is the same on every run of the same process, so a replay can hand each
+received frame to the endpoint that received it in the recording.
+*/
+
+constexpr static char WIRE_LOG_MAGIC[] = "HPWIRE01";
+constexpr static size_t WIRE_LOG_MAGIC_SIZE = sizeof(WIRE_LOG_MAGIC) - 1;
+
+enum class WireDirection : uint32_t {
+    SENT = 0,
+    RECEIVED = 1,
+};
+
+struct WireRecordHeader {
+    // since the recording started
+    uint64_t timeNs;
+    uint32_t endpoint;
+    // connection id on a server, 0 on a client
+    uint32_t connection;
+    WireDirection direction;
+    uint32_t length;
+};
+
+// Appends every frame sent or received by this process to a memory mapped log.
+class WireRecorder {
+public:
+
+    static WireRecorder& instance() {
+        static WireRecorder recorder;
+        return recorder;
+    }
+
+    ~WireRecorder() {
+        close();
+    }
+
+    // args are the command line the process was started with, so a replay can rebuild it
+    int open(const std::string& path, const std::string& role, const std::vector<std::string>& args) {
+        std::unique_lock<std::mutex> lock(writeLock);
+        if (output.open(path, true) != 0)
+            return -1;
+        output.write(WIRE_LOG_MAGIC, WIRE_LOG_MAGIC_SIZE);
+        writeString(role);
+        uint32_t numArgs = args.size();
+        output.write((const char*) &numArgs, sizeof(numArgs));
+        for(const std::string& arg: args) writeString(arg);
+        start = std::chrono::steady_clock::now();
+        recording.store(true);
+        return 0;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(writeLock);
+        if (!recording.load()) return;
+        recording.store(false);
+        output.close();
+    }
+
+    // called by every Server and Client as it starts
+    uint32_t attach() {
+        return nextEndpoint++;
+    }
+
+    bool isRecording() const {
+        return recording.load(std::memory_order_relaxed);
+    }
+
+    void record(uint32_t endpoint, uint32_t connection, WireDirection direction, const std::string& body) {
+        uint64_t timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        std::unique_lock<std::mutex> lock(writeLock);
+        // a transport thread may still be running after the log was closed
+        if (!recording.load()) return;
+        WireRecordHeader header{timeNs, endpoint, connection, direction, (uint32_t) body.size()};
+        output.write((const char*) &header, sizeof(header));
+        output.write(body.data(), body.size());
+    }
+
+private:
+    WireRecorder() = default;
+
+    void writeString(const std::string& str) {
+        uint32_t length = str.size();
+        output.write((const char*) &length, sizeof(length));
+        output.write(str.data(), str.size());
+    }
+
+    TraceOutput output;
+    std::mutex writeLock;
+    std::atomic<bool> recording{false};
+    std::atomic<uint32_t> nextEndpoint{0};
+    std::chrono::steady_clock::time_point start;
+};
+
+// Reads a wire log through a read only mapping of the whole file.
+class WireLogReader {
+public:
+
+    WireLogReader() = default;
+
+    ~WireLogReader() {
+        if (base != nullptr) munmap(base, size);
+    }
+
+    int open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: cannot open wire log " << path << ": " << strerror(errno) << '\n';
+            return -1;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t) WIRE_LOG_MAGIC_SIZE) {
+            std::cerr << "Error: " << path << " is not a wire log\n";
+            ::close(fd);
+            return -1;
+        }
+        size = info.st_size;
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "Error: cannot map wire log " << path << ": " << strerror(errno) << '\n';
+            return -1;
+        }
+        base = (char*) mapped;
+
+        if (memcmp(base, WIRE_LOG_MAGIC, WIRE_LOG_MAGIC_SIZE) != 0) {
+            std::cerr << "Error: " << path << " is not a wire log\n";
+            return -1;
+        }
+        offset = WIRE_LOG_MAGIC_SIZE;
+        role = readString();
+        uint32_t numArgs = readValue<uint32_t>();
+        for(uint32_t i = 0; i < numArgs; i++) args.push_back(readString());
+        return 0;
+    }
+
+    const std::string& getRole() const {
+        return role;
+    }
+
+    const std::vector<std::string>& getArgs() const {
+        return args;
+    }
+
+    // the next record and a pointer to its body, false at the end of the log
+    bool next(WireRecordHeader& header, const char*& body) {
+        if (offset == size) return false;
+        header = readValue<WireRecordHeader>();
+        body = take(header.length);
+        return true;
+    }
+
+private:
+    const char* take(size_t amount) {
+        if (size - offset < amount)
+            throw std::runtime_error("Wire log is truncated");
+        const char* data = base + offset;
+        offset += amount;
+        return data;
+    }
+
+    template<typename T>
+    T readValue() {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string readString() {
+        uint32_t length = readValue<uint32_t>();
+        return std::string(take(length), length);
+    }
+
+    char* base = nullptr;
+    size_t size = 0, offset = 0;
+    std::string role;
+    std::vector<std::string> args;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef WORKER_POOL
+#define WORKER_POOL
+
+#include "common_defs.h"
+#include "busy_poll.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+
+// Hands messages to a fixed set of worker threads. Messages submitted with
+// the same key always go to the same worker, so they are handled in the
+// order they were submitted; different keys are handled in parallel.
+class WorkerPool {
+public:
+
+    WorkerPool() = default;
+
+    ~WorkerPool() {
+        close();
+    }
+
+    void start(size_t numWorkers, std::function<void(size_t, std::string)> _handler) {
+        handler = _handler;
+        for(size_t i = 0; i < numWorkers; i++) {
+            workers.emplace_back(new Worker());
+            workers.back()->thread = std::thread(std::bind(&WorkerPool::main, this, workers.back().get()));
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    void submit(size_t key, std::string message) {
+        Worker& worker = *workers[key % workers.size()];
+        {
+            std::unique_lock<std::mutex> lock(worker.queueLock);
+            worker.pending.emplace_back(key, std::move(message));
+        }
+        worker.queueReady.notify_one();
+    }
+
+    // drains every submitted message, then stops the workers
+    void close() {
+        for(std::unique_ptr<Worker>& worker: workers) {
+            {
+                std::unique_lock<std::mutex> lock(worker->queueLock);
+                worker->stop = true;
+            }
+            worker->queueReady.notify_one();
+        }
+        for(std::unique_ptr<Worker>& worker: workers)
+            if (worker->thread.joinable()) worker->thread.join();
+        workers.clear();
+    }
+
+private:
+    struct Worker {
+        std::deque<std::pair<size_t, std::string>> pending;
+        std::mutex queueLock;
+        std::condition_variable queueReady;
+        bool stop = false;
+        std::thread thread;
+    };
+
+    void main(Worker* worker) {
+        PinnedThread pinned;
+        while (true) {
+            std::pair<size_t, std::string> message;
+            {
+                std::unique_lock<std::mutex> lock(worker->queueLock);
+                worker->queueReady.wait(lock, [worker]() { return worker->stop || !worker->pending.empty(); });
+                if (worker->pending.empty()) break;
+                message = std::move(worker->pending.front());
+                worker->pending.pop_front();
+            }
+            handler(message.first, std::move(message.second));
+        }
+    }
+
+    std::function<void(size_t, std::string)> handler;
+    std::vector<std::unique_ptr<Worker>> workers;
+};
+
+#endif